@@ -0,0 +1,269 @@
+#ifndef SYMMAT_APPROX_H
+#define SYMMAT_APPROX_H
+
+// Approximate search for strongly correlated pairs in tables too large for the
+// all-pairs table.
+//
+// Every row is centered and sketched with SimHash: one bit per random
+// hyperplane, the side of the hyperplane the row falls on. Two rows at angle
+// theta agree on a bit with probability 1 - theta / pi, and the angle between
+// centered rows is acos(r). The bits are cut into bands; rows whose keys agree
+// on a whole band (or, for negative correlations, whose keys are complements)
+// become candidate pairs. Only the candidates are correlated exactly and, if
+// |r| reaches the requested threshold, permutation tested.
+//
+// Recall is reported two ways: the collision probability of a pair right at
+// the threshold (stronger pairs are found more often), and the fraction of the
+// strong pairs among a random sample of all pairs that were candidates.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "correlation.h"
+#include "symmat.h"
+
+// Probability that a pair with correlation r collides in at least one of
+// tables bands of bits bits
+inline double CollisionProbability(double r, int bits, int tables)
+{
+	double agree = 1.0 - std::acos(std::min(1.0, std::fabs(r))) / M_PI;
+	return 1.0 - std::pow(1.0 - std::pow(agree, bits), tables);
+}
+
+// Approximate strong-pair search with the Pearson or cosine metric
+template <class Metric, class T, class Acc>
+void ApproxSearch(const double *input, int rows, int cols, long stride, const symmat::StrongPairOptions &approx, long MaxPerm, unsigned Seed, symmat::StrongPairs &result, Stats *stats = NULL)
+{
+	static_assert(std::is_same<Metric, PearsonMetric>::value || std::is_same<Metric, CosineMetric>::value,
+				  "SimHash approximates angles, so only Pearson and cosine are supported");
+	const bool centered = std::is_same<Metric, PearsonMetric>::value;
+	ThreadCounters *counters = stats ? &stats->counters(0) : NULL;
+	std::mt19937 RNG(Seed);
+	PairEngine<Metric, T, Acc> engine(input, rows, cols, stride, stats);
+	typename PairEngine<Metric, T, Acc>::Scratch scratch;
+
+	result = symmat::StrongPairs();
+	result.bits = approx.bits;
+	if (result.bits <= 0)
+	{
+		result.bits = (int)std::ceil(std::log2(std::max(rows, 2)));
+	}
+	result.bits = std::max(1, std::min(result.bits, 63));
+	result.tables = approx.tables;
+	if (result.tables <= 0)
+	{
+		double band = std::pow(1.0 - std::acos(std::min(1.0, std::fabs(approx.minR))) / M_PI, result.bits);
+		result.tables = band >= 1.0 ? 1 : (int)std::ceil(std::log(0.05) / std::log(1.0 - band));
+		result.tables = std::max(1, std::min(result.tables, 256));
+	}
+	result.expectedRecall = CollisionProbability(approx.minR, result.bits, result.tables);
+	int bits = result.bits, tables = result.tables;
+
+	//--------------------------------------------------------------------------------
+	// Sketch: band keys of every row, missing cells counted as the row mean
+
+	std::vector<uint64_t> keys((size_t)rows * tables);
+	std::vector<char> active(rows, 1);
+	{
+		PhaseTimer timer(stats, kPhaseStandardize);
+		std::normal_distribution<double> gaussian;
+		std::vector<double> planes((size_t)bits * tables * cols);
+		for (size_t i = 0; i < planes.size(); i++)
+		{
+			planes[i] = gaussian(RNG);
+		}
+		std::vector<double> row(cols);
+		for (int r = 0; r < rows; r++)
+		{
+			const double *raw = input + (size_t)r * stride;
+			double Sum = 0.0;
+			int count = 0;
+			for (int i = 0; i < cols; i++)
+			{
+				if (raw[i] == raw[i])
+				{
+					Sum += raw[i];
+					count++;
+				}
+			}
+			double Mean = (centered && count > 0) ? Sum / count : 0.0;
+			// a row that standardizes to zero (constant for Pearson, all zero
+			// for cosine) has coefficient 0 with every other row, but would get
+			// the all-ones key of every band, so it gets no key at all. Tested
+			// on the raw values: centering leaves rounding noise behind.
+			double first = centered ? NAN : 0.0;
+			bool flat = true;
+			for (int i = 0; i < cols && flat; i++)
+			{
+				if (raw[i] == raw[i])
+				{
+					first = first == first ? first : raw[i];
+					flat = raw[i] == first;
+				}
+			}
+			if (flat)
+			{
+				active[r] = 0;
+				continue;
+			}
+			for (int i = 0; i < cols; i++)
+			{
+				row[i] = raw[i] == raw[i] ? raw[i] - Mean : 0.0;
+			}
+			for (int band = 0; band < tables; band++)
+			{
+				uint64_t key = 0;
+				for (int bit = 0; bit < bits; bit++)
+				{
+					const double *plane = &planes[((size_t)band * bits + bit) * cols];
+					double Dot = 0.0;
+					for (int i = 0; i < cols; i++)
+					{
+						Dot += row[i] * plane[i];
+					}
+					key |= (uint64_t)(Dot >= 0.0) << bit;
+				}
+				keys[(size_t)r * tables + band] = key;
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------------
+	// Candidates: same key in some band (r > 0) or complementary keys (r < 0).
+	// A pair that collides in several bands is kept once: every band's pairs
+	// are merged into the sorted candidate list as soon as the band is done, so
+	// memory follows the distinct pairs rather than the collisions.
+
+	std::vector<uint64_t> candidates;
+	{
+		PhaseTimer timer(stats, kPhaseCorrelate);
+		uint64_t all = ((uint64_t)1 << bits) - 1;
+		std::vector<std::pair<uint64_t, int>> bucket;
+		std::vector<uint64_t> bandPairs, merged;
+		for (int band = 0; band < tables; band++)
+		{
+			bucket.clear();
+			for (int r = 0; r < rows; r++)
+			{
+				if (active[r])
+				{
+					bucket.push_back(std::make_pair(keys[(size_t)r * tables + band], r));
+				}
+			}
+			std::sort(bucket.begin(), bucket.end());
+			bandPairs.clear();
+			for (int r = 0; r < rows; r++)
+			{
+				if (!active[r])
+				{
+					continue;
+				}
+				uint64_t key = keys[(size_t)r * tables + band];
+				uint64_t wanted[2] = {key, key ^ all};
+				for (int side = 0; side < 2; side++)
+				{
+					auto first = std::lower_bound(bucket.begin(), bucket.end(), std::make_pair(wanted[side], 0));
+					for (auto it = first; it != bucket.end() && it->first == wanted[side]; ++it)
+					{
+						if (it->second > r)
+						{
+							bandPairs.push_back((uint64_t)r * rows + it->second);
+						}
+					}
+				}
+			}
+			// a pair shares a key or has complementary keys, not both, so the
+			// band has no duplicates of its own
+			std::sort(bandPairs.begin(), bandPairs.end());
+			merged.clear();
+			merged.reserve(candidates.size() + bandPairs.size());
+			std::set_union(candidates.begin(), candidates.end(), bandPairs.begin(), bandPairs.end(), std::back_inserter(merged));
+			candidates.swap(merged);
+		}
+		std::vector<uint64_t>().swap(merged);
+		result.candidates = (long)candidates.size();
+		if (stats)
+		{
+			stats->expect(kPhaseCorrelate, result.candidates);
+		}
+
+		// exact correlation of the candidates
+		for (size_t c = 0; c < candidates.size(); c++)
+		{
+			int a = (int)(candidates[c] / rows), b = (int)(candidates[c] % rows);
+			double r = engine.statistic(a, b, scratch);
+			if (std::fabs(r) >= approx.minR)
+			{
+				result.pairs.push_back({a, b, r, NAN});
+			}
+			if (counters)
+			{
+				counters->addPairs(1);
+			}
+		}
+		std::sort(result.pairs.begin(), result.pairs.end(), [](const symmat::StrongPair &x, const symmat::StrongPair &y) {
+			return std::fabs(x.r) > std::fabs(y.r);
+		});
+	}
+
+	//--------------------------------------------------------------------------------
+	// Recall estimate from a sample of all pairs (every pair if there are few)
+
+	long pairs = (long)rows * (rows - 1) / 2;
+	auto sample = [&](int a, int b) {
+		result.sampledPairs++;
+		if (std::fabs(engine.statistic(a, b, scratch)) >= approx.minR)
+		{
+			result.sampledStrong++;
+			if (std::binary_search(candidates.begin(), candidates.end(), (uint64_t)a * rows + b))
+			{
+				result.sampledFound++;
+			}
+		}
+	};
+	if (pairs <= approx.recallSample)
+	{
+		for (int a = 0; a < rows; a++)
+		{
+			for (int b = a + 1; b < rows; b++)
+			{
+				sample(a, b);
+			}
+		}
+	}
+	else
+	{
+		for (long s = 0; s < approx.recallSample; s++)
+		{
+			int a = (int)BoundedRandom(RNG, rows);
+			int b = (int)BoundedRandom(RNG, rows - 1);
+			b += b >= a;
+			sample(std::min(a, b), std::max(a, b));
+		}
+	}
+
+	//--------------------------------------------------------------------------------
+	// Permutation tests of the strong pairs only
+
+	if (MaxPerm <= 0)
+	{
+		return;
+	}
+	if (stats)
+	{
+		stats->expect(kPhasePermute, (long)result.pairs.size() * MaxPerm);
+	}
+	PhaseTimer timer(stats, kPhasePermute);
+	for (size_t i = 0; i < result.pairs.size(); i++)
+	{
+		result.pairs[i].p = engine.pValue(result.pairs[i].a, result.pairs[i].b, MaxPerm, RNG, scratch, counters);
+	}
+}
+
+#endif
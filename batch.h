@@ -0,0 +1,267 @@
+#ifndef SYMMAT_BATCH_H
+#define SYMMAT_BATCH_H
+
+// Batch mode: run many input tables in one process.
+//
+// A loader thread parses the tables in order into a bounded queue, so the next
+// tables are read while the current ones are computed. Every table is one task
+// on a thread pool, and at most about one task per worker is in flight, so
+// many small tables keep every core busy without the whole batch being held in
+// memory. Each table's report goes to its own file, <file name>.out.txt in the
+// output directory (a.txt gives a.txt.out.txt), identical to what a single run
+// of that table prints. Inputs whose file names would still share an output
+// file (the same name in two directories of a list) fail, all but the first.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "report.h"
+#include "stats.h"
+#include "symmat.h"
+#include "table.h"
+#include "threadpool.h"
+
+const char *const kBatchOutputSuffix = ".out.txt";
+
+struct BatchOptions
+{
+	std::string outputDir = ".";
+	// worker threads; 0 uses one per core
+	int threads = 0;
+	// parsed tables waiting for a worker; 0 picks two
+	int prefetch = 0;
+	bool approxMode = false;
+	symmat::StrongPairOptions approx;
+};
+
+inline bool endsWith(const std::string &s, const std::string &suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// The input tables named by source: the files of a directory (sorted, leaving
+// out hidden files and earlier batch outputs), or the lines of a list file.
+// False if source cannot be read.
+inline bool listBatchInputs(const std::string &source, std::vector<std::string> &inputs)
+{
+	inputs.clear();
+	struct stat info;
+	if (stat(source.c_str(), &info) != 0)
+	{
+		return false;
+	}
+	if (S_ISDIR(info.st_mode))
+	{
+		DIR *dir = opendir(source.c_str());
+		if (!dir)
+		{
+			return false;
+		}
+		while (struct dirent *entry = readdir(dir))
+		{
+			std::string name(entry->d_name);
+			std::string path = source + "/" + name;
+			if (name[0] == '.' || endsWith(name, kBatchOutputSuffix) || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+			{
+				continue;
+			}
+			inputs.push_back(path);
+		}
+		closedir(dir);
+		std::sort(inputs.begin(), inputs.end());
+		return true;
+	}
+	std::ifstream list(source);
+	if (!list.good())
+	{
+		return false;
+	}
+	std::string line;
+	while (std::getline(list, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+		{
+			line.erase(line.size() - 1);
+		}
+		if (!line.empty() && line[0] != '#')
+		{
+			inputs.push_back(line);
+		}
+	}
+	return true;
+}
+
+// outputDir/<input file name>.out.txt; the extension is kept so a.txt and
+// a.tsv do not write the same file
+inline std::string batchOutputName(const std::string &input, const std::string &outputDir)
+{
+	size_t slash = input.find_last_of('/');
+	std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+	return outputDir + "/" + name + kBatchOutputSuffix;
+}
+
+// For every input, the earlier input it shares an output file with, or -1
+inline std::vector<long> batchOutputClashes(const std::vector<std::string> &inputs, const std::string &outputDir)
+{
+	std::map<std::string, long> first;
+	std::vector<long> clashes(inputs.size(), -1);
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		auto inserted = first.insert(std::make_pair(batchOutputName(inputs[i], outputDir), (long)i));
+		if (!inserted.second)
+		{
+			clashes[i] = inserted.first->second;
+		}
+	}
+	return clashes;
+}
+
+struct BatchItem
+{
+	size_t index = 0;
+	bool ok = false;
+	// earlier input with the same output file, empty if none
+	std::string clash;
+	Table table;
+};
+
+// Compute one table and write its report; false on failure, with the reason in
+// error
+inline bool runBatchItem(const std::string &input, const BatchItem &item, const symmat::Options &options, const BatchOptions &batch,
+						 std::string &outputName, std::string &error)
+{
+	outputName = batchOutputName(input, batch.outputDir);
+	if (!item.clash.empty())
+	{
+		error = "same output file \"" + outputName + "\" as " + item.clash;
+		return false;
+	}
+	if (!item.ok)
+	{
+		error = "cannot read file";
+		return false;
+	}
+	std::ofstream out(outputName);
+	if (!out)
+	{
+		error = "cannot write \"" + outputName + "\"";
+		return false;
+	}
+	out << std::setprecision(6);
+	printHeader(out, item.table);
+	symmat::Matrix matrix;
+	matrix.data = item.table.values.data();
+	matrix.rows = item.table.rows;
+	matrix.cols = item.table.cols;
+	if (batch.approxMode)
+	{
+		symmat::StrongPairs result;
+		if (!symmat::findStrongPairs(matrix, options, batch.approx, result, &error))
+		{
+			return false;
+		}
+		printAssociations(out, item.table, result, batch.approx, options.permutations);
+	}
+	else
+	{
+		symmat::Result result;
+		if (!symmat::correlate(matrix, options, result, &error))
+		{
+			return false;
+		}
+		printTable(out, item.table, result, options.metric, options.permutations);
+	}
+	out.close();
+	if (!out)
+	{
+		error = "cannot write \"" + outputName + "\"";
+		return false;
+	}
+	return true;
+}
+
+// Run every input table with options; returns the number of tables that
+// failed. If log is given, one line per table goes there as it finishes. If
+// stats is given (with a counter slot per worker thread), the pairs and
+// permutations of every table are counted in the slot of its worker.
+inline int RunBatch(const std::vector<std::string> &inputs, const symmat::Options &options, const BatchOptions &batch, Stats *stats = NULL,
+					std::ostream *log = NULL)
+{
+	mkdir(batch.outputDir.c_str(), 0777);
+	symmat::Options runOptions = options;
+	runOptions.stats = NULL;
+	ThreadPool pool(batch.threads);
+	BoundedQueue<std::shared_ptr<BatchItem>> loaded(batch.prefetch > 0 ? batch.prefetch : 2);
+	std::atomic<int> failed(0), done(0);
+	std::mutex logMutex;
+	std::vector<long> clashes = batchOutputClashes(inputs, batch.outputDir);
+
+	std::thread loader([&] {
+		for (size_t i = 0; i < inputs.size(); i++)
+		{
+			std::shared_ptr<BatchItem> item(new BatchItem);
+			item->index = i;
+			item->clash = clashes[i] >= 0 ? inputs[clashes[i]] : "";
+			item->ok = item->clash.empty() && readTable(inputs[i].c_str(), item->table);
+			loaded.push(item);
+		}
+		loaded.close();
+	});
+
+	std::shared_ptr<BatchItem> next;
+	while (loaded.pop(next))
+	{
+		// one task running per worker and one queued behind them
+		pool.wait(pool.size());
+		std::shared_ptr<BatchItem> item = next;
+		pool.submit([&, item](int worker) {
+			auto start = std::chrono::steady_clock::now();
+			const std::string &input = inputs[item->index];
+			std::string outputName, error;
+			bool ok = runBatchItem(input, *item, runOptions, batch, outputName, error);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (!ok)
+			{
+				failed++;
+			}
+			else if (stats && !batch.approxMode)
+			{
+				long pairs = (long)item->table.rows * (item->table.rows - 1) / 2;
+				stats->counters(worker).addPairs(pairs);
+				stats->counters(worker).addPermutations(pairs * std::max(runOptions.permutations, 0L));
+			}
+			int count = ++done;
+			if (log)
+			{
+				std::lock_guard<std::mutex> lock(logMutex);
+				*log << "batch: [" << count << "/" << inputs.size() << "] " << input;
+				if (ok)
+				{
+					*log << " -> " << outputName << " (" << std::setprecision(3) << seconds << " s)\n";
+				}
+				else
+				{
+					*log << ": " << error << "\n";
+				}
+				log->flush();
+			}
+		});
+	}
+	loader.join();
+	pool.wait();
+	return failed;
+}
+
+#endif
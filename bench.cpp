@@ -0,0 +1,560 @@
+/*
+
+Benchmarks for the correlation engine.
+
+Micro-benchmarks time table parsing, Pearson() and the dot kernels, the
+Fisher-Yates shuffle and permutation throughput for a range of row lengths.
+Macro-benchmarks time full runs (parse + correlate + permute) for every metric
+on CockroachDietMicrobiomePropTable12.txt with its rows replicated to larger
+sizes.
+Every input is generated from a fixed seed, so runs are comparable between
+machines and commits.
+
+Build and run from the repository root:
+
+	g++ -O2 -pthread bench.cpp symmat.cpp -o bench
+	./bench [--quick] [--json <results.json>] [--table <Table.txt>]
+	        [--compare <baseline.json> [--tolerance <fraction>]]
+
+--quick shortens every measurement (for a smoke test, not for comparisons).
+Results are printed as a table and written as JSON (default bench_results.json).
+
+--compare matches every result to the baseline entry with the same group, name
+and params and exits with status 1 if any itemsPerSecond fell below the
+baseline by more than the tolerance (default 0.10, i.e. 10%). Results missing
+from either side are listed but do not fail the comparison.
+
+The synthetic table generator can also be used on its own:
+
+	./bench --generate <rows> <columns> <sparsity> <seed> <OutFile>
+
+writes a table in the same format as the input files, with the given fraction
+of zero cells and every row scaled to proportions.
+
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <thread>
+
+#include "correlation.h"
+#include "symmat.h"
+#include "table.h"
+
+using namespace std;
+
+struct BenchResult
+{
+	string group;
+	string name;
+	vector<pair<string, double>> params;
+	double secondsPerCall;
+	double itemsPerCall;
+	string unit;
+};
+
+static vector<BenchResult> results;
+static double minTime = 0.5;
+static volatile double sink;
+
+// Best-of-three seconds per call of f, each repetition running f often enough
+// to last at least minTime
+template <class F>
+double timeIt(F f)
+{
+	typedef chrono::steady_clock Clock;
+	f();
+	long calls = 1;
+	double best = 1e300;
+	for (int repetition = 0; repetition < 3; repetition++)
+	{
+		while (true)
+		{
+			Clock::time_point start = Clock::now();
+			for (long i = 0; i < calls; i++)
+			{
+				f();
+			}
+			double seconds = chrono::duration<double>(Clock::now() - start).count();
+			if (seconds >= minTime || calls >= (1L << 40))
+			{
+				best = min(best, seconds / calls);
+				break;
+			}
+			calls = seconds > 0 ? max(calls * 2, (long)(calls * minTime * 1.2 / seconds)) : calls * 16;
+		}
+	}
+	return best;
+}
+
+void record(string group, string name, vector<pair<string, double>> params, double secondsPerCall, double itemsPerCall, string unit)
+{
+	results.push_back({group, name, params, secondsPerCall, itemsPerCall, unit});
+	cout << left << setw(8) << group << setw(28) << name;
+	for (size_t i = 0; i < params.size(); i++)
+	{
+		cout << params[i].first << "=" << setw(8) << params[i].second << " ";
+	}
+	cout << right << setw(14) << setprecision(4) << itemsPerCall / secondsPerCall << " " << unit << "/s\n";
+}
+
+//--------------------------------------------------------------------------------
+// Synthetic tables
+
+Table generateTable(int rows, int cols, double sparsity, unsigned seed)
+{
+	mt19937 RNG(seed);
+	uniform_real_distribution<double> uniform(0.0, 1.0);
+	lognormal_distribution<double> abundance(0.0, 1.5);
+	Table table;
+	table.rows = rows;
+	table.cols = cols;
+	table.values.assign((size_t)rows * cols, 0.0);
+	for (int col = 0; col < cols; col++)
+	{
+		table.columnNames.push_back("Taxon" + to_string(col + 1));
+	}
+	for (int row = 0; row < rows; row++)
+	{
+		table.rowNames.push_back("Sample" + to_string(row + 1));
+		double *values = &table.values[(size_t)row * cols];
+		double sum = 0.0;
+		for (int col = 0; col < cols; col++)
+		{
+			values[col] = uniform(RNG) < sparsity ? 0.0 : abundance(RNG);
+			sum += values[col];
+		}
+		for (int col = 0; col < cols && sum > 0; col++)
+		{
+			values[col] /= sum;
+		}
+	}
+	return table;
+}
+
+// The input table with every row repeated factor times, each copy multiplied
+// by a little noise so the copies are not perfectly correlated
+Table scaleTable(const Table &input, int factor, unsigned seed)
+{
+	mt19937 RNG(seed);
+	lognormal_distribution<double> jitter(0.0, 0.1);
+	Table table;
+	table.rows = input.rows * factor;
+	table.cols = input.cols;
+	table.columnNames = input.columnNames;
+	for (int copy = 0; copy < factor; copy++)
+	{
+		for (int row = 0; row < input.rows; row++)
+		{
+			table.rowNames.push_back(input.rowNames[row] + "_" + to_string(copy + 1));
+			for (int col = 0; col < input.cols; col++)
+			{
+				double value = input.values[(size_t)row * input.cols + col];
+				table.values.push_back(copy == 0 ? value : value * jitter(RNG));
+			}
+		}
+	}
+	return table;
+}
+
+bool writeTable(const string &filename, const Table &table)
+{
+	FILE *out = fopen(filename.c_str(), "w");
+	if (!out)
+	{
+		return false;
+	}
+	for (int col = 0; col < table.cols; col++)
+	{
+		fprintf(out, "\t%s", table.columnNames[col].c_str());
+	}
+	fprintf(out, "\n");
+	for (int row = 0; row < table.rows; row++)
+	{
+		fprintf(out, "%s", table.rowNames[row].c_str());
+		for (int col = 0; col < table.cols; col++)
+		{
+			fprintf(out, "\t%.9g", table.values[(size_t)row * table.cols + col]);
+		}
+		fprintf(out, "\n");
+	}
+	return fclose(out) == 0;
+}
+
+long fileSize(const string &filename)
+{
+	ifstream in(filename, ios::binary | ios::ate);
+	return (long)in.tellg();
+}
+
+// Standardized copy of the rows in precision T
+template <class T>
+vector<T> standardizedRows(const Table &table)
+{
+	vector<T> rows(table.values.size());
+	vector<double> row(table.cols);
+	for (int r = 0; r < table.rows; r++)
+	{
+		copy(&table.values[(size_t)r * table.cols], &table.values[(size_t)r * table.cols] + table.cols, row.begin());
+		Standardize(&row[0], table.cols);
+		copy(row.begin(), row.end(), &rows[(size_t)r * table.cols]);
+	}
+	return rows;
+}
+
+//--------------------------------------------------------------------------------
+// Micro-benchmarks
+
+void benchParse(bool quick)
+{
+	int shapes[][2] = {{12, 57}, {1000, 57}, {200, 1000}};
+	for (auto &shape : shapes)
+	{
+		if (quick && shape[0] * shape[1] > 100000)
+		{
+			continue;
+		}
+		string filename = "bench_parse_tmp.txt";
+		writeTable(filename, generateTable(shape[0], shape[1], 0.3, 1));
+		double bytes = fileSize(filename);
+		Table table;
+		double seconds = timeIt([&] { readTable(filename.c_str(), table); sink = table.values[0]; });
+		record("micro", "parse", {{"rows", shape[0]}, {"cols", shape[1]}, {"MB", bytes / 1e6}}, seconds, (double)shape[0] * shape[1], "cells");
+		remove(filename.c_str());
+	}
+}
+
+const int kPairRows = 64;
+
+void benchPearson(int width)
+{
+	Table table = generateTable(kPairRows, width, 0.3, 2);
+	int pairs = kPairRows * (kPairRows - 1) / 2;
+	vector<pair<string, double>> params = {{"width", width}};
+
+	double seconds = timeIt([&] {
+		double sum = 0.0;
+		for (int i = 0; i < kPairRows; i++)
+			for (int j = i + 1; j < kPairRows; j++)
+				sum += Pearson(&table.values[(size_t)i * width], &table.values[(size_t)j * width], width);
+		sink = sum;
+	});
+	record("micro", "pearson/raw", params, seconds, pairs, "pairs");
+
+	vector<double> rowsDouble = standardizedRows<double>(table);
+	vector<float> rowsFloat = standardizedRows<float>(table);
+	auto dotPairs = [&](string name, auto Dot, auto &rows) {
+		double seconds = timeIt([&] {
+			double sum = 0.0;
+			for (int i = 0; i < kPairRows; i++)
+				for (int j = i + 1; j < kPairRows; j++)
+					sum += Dot(&rows[(size_t)i * width], &rows[(size_t)j * width], width);
+			sink = sum;
+		});
+		record("micro", name, params, seconds, pairs, "pairs");
+	};
+	dotPairs("dot/double-generic", SumGeneric<double, double, DotTerm>, rowsDouble);
+	dotPairs("dot/double", SelectSumKernel<double, double, DotTerm>(width), rowsDouble);
+	dotPairs("dot/float", SelectSumKernel<float, float, DotTerm>(width), rowsFloat);
+	dotPairs("dot/mixed", SelectSumKernel<float, double, DotTerm>(width), rowsFloat);
+}
+
+void benchShuffle(int width)
+{
+	vector<double> row(width);
+	for (int i = 0; i < width; i++)
+	{
+		row[i] = i;
+	}
+	mt19937 RNG(3);
+	const int shuffles = 1000;
+	double seconds = timeIt([&] {
+		for (int s = 0; s < shuffles; s++)
+		{
+			for (int i = width - 1; i > 0; --i)
+			{
+				uint32_t j = BoundedRandom(RNG, i + 1);
+				swap(row[i], row[j]);
+			}
+		}
+		sink = row[0];
+	});
+	record("micro", "shuffle", {{"width", width}}, seconds, shuffles, "shuffles");
+}
+
+void benchPermute(int width)
+{
+	Table table = generateTable(2, width, 0.3, 4);
+	vector<double> rowsDouble = standardizedRows<double>(table);
+	vector<float> rowsFloat = standardizedRows<float>(table);
+	const long perms = 10000;
+	vector<pair<string, double>> params = {{"width", width}};
+	mt19937 RNG(5);
+	auto permute = [&](string name, auto Permute, auto &rows) {
+		double seconds = timeIt([&] { sink = Permute(&rows[0], &rows[width], width, perms, 0.5, RNG); });
+		record("micro", name, params, seconds, perms, "perms");
+	};
+	permute("permute/double-generic", PermuteGeneric<double, double, DotTerm>, rowsDouble);
+	permute("permute/double", SelectPermuteKernel<double, double, DotTerm>(width), rowsDouble);
+	permute("permute/float", SelectPermuteKernel<float, float, DotTerm>(width), rowsFloat);
+	permute("permute/mixed", SelectPermuteKernel<float, double, DotTerm>(width), rowsFloat);
+}
+
+//--------------------------------------------------------------------------------
+// Macro-benchmarks: full runs on the example table at scaled sizes
+
+void benchFullRuns(const string &tableFile, bool quick)
+{
+	Table base;
+	if (!readTable(tableFile.c_str(), base) || base.rows < 2)
+	{
+		cout << "Cannot read \"" << tableFile << "\", skipping macro-benchmarks\n";
+		return;
+	}
+	int factors[] = {1, 4, 16};
+	long perms = quick ? 100 : 2000;
+	for (int factor : factors)
+	{
+		if (quick && factor > 4)
+		{
+			continue;
+		}
+		string filename = "bench_full_tmp.txt";
+		writeTable(filename, scaleTable(base, factor, 6));
+		int rows = base.rows * factor;
+		double pairs = (double)rows * (rows - 1) / 2;
+		auto fullRun = [&](string metric, string precision, int threads) {
+			symmat::Options options;
+			options.metric = metric;
+			options.precision = precision;
+			options.permutations = perms;
+			options.seed = 7;
+			options.threads = threads;
+			double seconds = timeIt([&] {
+				Table table;
+				readTable(filename.c_str(), table);
+				symmat::Matrix matrix;
+				matrix.data = table.values.data();
+				matrix.rows = table.rows;
+				matrix.cols = table.cols;
+				symmat::Result output;
+				symmat::correlate(matrix, options, output);
+				sink = output.values[0];
+			});
+			string name = "full/" + metric + "/" + precision + (threads != 1 ? "/threads" : "");
+			record("macro", name, {{"rows", rows}, {"cols", base.cols}, {"perms", (double)perms}, {"threads", (double)threads}}, seconds, pairs * perms,
+				   "perms");
+		};
+		for (string precision : {"double", "float", "mixed"})
+		{
+			fullRun("pearson", precision, 1);
+		}
+		// work-stealing scheduler on every core
+		if (thread::hardware_concurrency() > 1)
+		{
+			fullRun("pearson", "double", (int)thread::hardware_concurrency());
+		}
+		for (string metric : {"cosine", "jaccard", "bray-curtis", "rho"})
+		{
+			fullRun(metric, "double", 1);
+		}
+		remove(filename.c_str());
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+// The params of a result as the JSON object writeJson() writes, which also
+// serves as the key to match results against a baseline
+string paramsJson(const vector<pair<string, double>> &params)
+{
+	ostringstream out;
+	out << setprecision(9) << "{";
+	for (size_t p = 0; p < params.size(); p++)
+	{
+		out << (p ? ", " : "") << "\"" << params[p].first << "\": " << params[p].second;
+	}
+	out << "}";
+	return out.str();
+}
+
+bool writeJson(const string &filename, bool quick)
+{
+	ofstream out(filename);
+	if (!out)
+	{
+		return false;
+	}
+	out << setprecision(9);
+	out << "{\n  \"quick\": " << (quick ? "true" : "false") << ",\n";
+	out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+	out << "  \"maxFixedLength\": " << kMaxFixedLength << ",\n";
+	out << "  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult &result = results[i];
+		out << "    {\"group\": \"" << result.group << "\", \"name\": \"" << result.name << "\", \"params\": " << paramsJson(result.params)
+			<< ", \"secondsPerCall\": " << result.secondsPerCall << ", \"itemsPerCall\": " << result.itemsPerCall
+			<< ", \"unit\": \"" << result.unit << "\", \"itemsPerSecond\": " << result.itemsPerCall / result.secondsPerCall << "}"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+	return true;
+}
+
+// Text of the JSON string after "key": in line, empty if missing
+static string jsonString(const string &line, const string &key)
+{
+	size_t start = line.find("\"" + key + "\": \"");
+	if (start == string::npos)
+	{
+		return "";
+	}
+	start += key.size() + 5;
+	return line.substr(start, line.find('"', start) - start);
+}
+
+// Reads the benchmarks of a JSON file written by writeJson() (one per line)
+// and compares the results of this run against them: items per second more
+// than tolerance below the baseline count as regressions. False if any result
+// regressed or the baseline cannot be read.
+bool compareJson(const string &filename, double tolerance)
+{
+	ifstream in(filename);
+	if (!in)
+	{
+		cout << "Cannot read file \"" << filename << "\"\n";
+		return false;
+	}
+	map<string, double> baseline;
+	string line;
+	while (getline(in, line))
+	{
+		size_t params = line.find("\"params\": {");
+		size_t rate = line.find("\"itemsPerSecond\": ");
+		if (params == string::npos || rate == string::npos)
+		{
+			continue;
+		}
+		params += 10;
+		string key = jsonString(line, "group") + " " + jsonString(line, "name") + " " + line.substr(params, line.find('}', params) + 1 - params);
+		baseline[key] = atof(line.c_str() + rate + 18);
+	}
+
+	cout << setprecision(6) << "\nComparison with " << filename << " (tolerance " << tolerance * 100 << "%)\n";
+	int regressions = 0;
+	int missing = 0;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult &result = results[i];
+		string key = result.group + " " + result.name + " " + paramsJson(result.params);
+		map<string, double>::iterator base = baseline.find(key);
+		if (base == baseline.end())
+		{
+			cout << "  new       " << key << "\n";
+			missing++;
+			continue;
+		}
+		double rate = result.itemsPerCall / result.secondsPerCall;
+		double change = base->second > 0 ? rate / base->second - 1.0 : 0.0;
+		bool regressed = change < -tolerance;
+		regressions += regressed;
+		cout << "  " << left << setw(10) << (regressed ? "REGRESSED" : "ok") << key << "  " << right << showpos << fixed << setprecision(1)
+			 << change * 100 << "%" << noshowpos << defaultfloat << setprecision(6) << "\n";
+		baseline.erase(base);
+	}
+	for (map<string, double>::iterator base = baseline.begin(); base != baseline.end(); ++base)
+	{
+		cout << "  missing   " << base->first << "\n";
+	}
+	cout << regressions << " regression" << (regressions == 1 ? "" : "s") << " beyond " << tolerance * 100 << "%, " << missing
+		 << " new and " << baseline.size() << " missing result" << (baseline.size() == 1 ? "" : "s") << "\n";
+	return regressions == 0;
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = false;
+	string jsonFile = "bench_results.json";
+	string tableFile = "CockroachDietMicrobiomePropTable12.txt";
+	string compareFile;
+	double tolerance = 0.10;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg(argv[i]);
+		if (arg == "--quick")
+		{
+			quick = true;
+		}
+		else if (arg == "--json" && i + 1 < argc)
+		{
+			jsonFile = argv[++i];
+		}
+		else if (arg == "--table" && i + 1 < argc)
+		{
+			tableFile = argv[++i];
+		}
+		else if (arg == "--compare" && i + 1 < argc)
+		{
+			compareFile = argv[++i];
+		}
+		else if (arg == "--tolerance" && i + 1 < argc)
+		{
+			tolerance = atof(argv[++i]);
+		}
+		else if (arg == "--generate" && i + 5 < argc)
+		{
+			Table table = generateTable(atoi(argv[i + 1]), atoi(argv[i + 2]), atof(argv[i + 3]), strtoul(argv[i + 4], NULL, 10));
+			if (!writeTable(argv[i + 5], table))
+			{
+				cout << "Cannot write file \"" << argv[i + 5] << "\"\n";
+				return 1;
+			}
+			return 0;
+		}
+		else
+		{
+			cout << "Use as:  " << argv[0] << " [--quick] [--json <results.json>] [--table <Table.txt>]\n";
+			cout << "                 [--compare <baseline.json> [--tolerance <fraction>]]\n";
+			cout << "         " << argv[0] << " --generate <rows> <columns> <sparsity> <seed> <OutFile>\n";
+			return 0;
+		}
+	}
+	if (quick)
+	{
+		minTime = 0.05;
+	}
+
+	benchParse(quick);
+	for (int width : {8, 16, 32, 57, 64, 128, 512})
+	{
+		benchPearson(width);
+	}
+	for (int width : {16, 57, 64, 128})
+	{
+		benchShuffle(width);
+		benchPermute(width);
+	}
+	benchFullRuns(tableFile, quick);
+
+	// compared before writing, in case the baseline is the output file
+	bool passed = compareFile.empty() || compareJson(compareFile, tolerance);
+	if (!writeJson(jsonFile, quick))
+	{
+		cout << "Cannot write file \"" << jsonFile << "\"\n";
+		return 1;
+	}
+	cout << "Results written to " << jsonFile << "\n";
+	return passed ? 0 : 1;
+}
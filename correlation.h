@@ -0,0 +1,577 @@
+#ifndef SYMMAT_CORRELATION_H
+#define SYMMAT_CORRELATION_H
+
+// Pairwise similarity and permutation tests, and the all-pairs table
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "masks.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "stats.h"
+
+// Permutations are run in chunks of this size so the progress counters move
+// even while a single pair is being tested
+const long kPermutationChunk = 1L << 16;
+
+// Consecutive pairs per task of the parallel correlate phase
+const long kPairTile = 4096;
+
+// A pair with missing cells, computed over the cells valid in both rows
+template <class Metric, class T>
+struct CompletePair
+{
+	std::vector<uint64_t> mask;
+	int count = 0;
+	std::vector<double> x, y;
+	std::vector<T> X, Y;
+	RowInfo infoX, infoY;
+
+	// AND the two validity masks; returns the number of complete cells
+	int intersect(const uint64_t *maskX, const uint64_t *maskY, int cols)
+	{
+		mask.resize(MaskWords(cols));
+		count = AndMasks(maskX, maskY, MaskWords(cols), &mask[0]);
+		return count;
+	}
+
+	// Gather the complete cells of both rows and preprocess them like dense rows
+	void gather(const double *rawX, const double *rawY, int cols)
+	{
+		x.resize(cols);
+		y.resize(cols);
+		GatherMasked(rawX, &mask[0], MaskWords(cols), &x[0]);
+		GatherMasked(rawY, &mask[0], MaskWords(cols), &y[0]);
+		Metric::precompute(&x[0], count, infoX);
+		Metric::precompute(&y[0], count, infoY);
+		X.assign(x.begin(), x.begin() + count);
+		Y.assign(y.begin(), y.begin() + count);
+	}
+};
+
+// Metric value of a pair with missing cells. The default gathers the complete
+// cells and runs the dense kernel on them; metrics with a masked formula that
+// needs no gathering overload this. filledX and filledY hold 0 for missing cells.
+template <class T, class Acc, class Metric>
+double MaskedStatistic(Metric, CompletePair<Metric, T> &pair, const double *filledX, const double *filledY, int cols)
+{
+	if (pair.count < 2)
+	{
+		return NAN;
+	}
+	pair.gather(filledX, filledY, cols);
+	double sum = SelectSumKernel<T, Acc, typename Metric::Term>(pair.count)(&pair.X[0], &pair.Y[0], pair.count);
+	return Metric::statistic(sum, pair.infoX, pair.infoY);
+}
+
+template <class T, class Acc>
+double MaskedStatistic(PearsonMetric, CompletePair<PearsonMetric, T> &pair, const double *filledX, const double *filledY, int cols)
+{
+	return MaskedPearson(filledX, filledY, &pair.mask[0], cols, pair.count);
+}
+
+// Preprocessed rows of a table and the operations on a single pair: its metric
+// value and a permutation test. NaN cells in input are missing values. Pairs
+// of complete rows take the dense kernels for the row length; any other pair
+// is computed and permuted over the cells valid in both rows (see masks.h).
+// input is borrowed, not copied, and must outlive the engine; row r starts at
+// input + r * stride.
+//
+// The engine is read-only once built, so several threads can use it at once
+// as long as each passes its own Scratch.
+template <class Metric, class T, class Acc>
+class PairEngine
+{
+public:
+	typedef typename Metric::Term Term;
+	typedef CompletePair<Metric, T> Scratch;
+
+	PairEngine(const double *input, int rows, int cols, long stride, Stats *stats = NULL)
+		: input(input), stride(stride), numberOfRows(rows), numberOfColumns(cols), words(MaskWords(cols)),
+		  valid((size_t)rows * words), complete(rows), prepared((size_t)rows * cols), info(rows)
+	{
+		PhaseTimer timer(stats, kPhaseStandardize);
+		bool anyMissing = false;
+		std::vector<double> row(cols);
+		for (int microbiome = 0; microbiome < rows; microbiome++)
+		{
+			const double *raw = input + (size_t)microbiome * stride;
+			complete[microbiome] = BuildMask(raw, cols, &valid[(size_t)microbiome * words]) == cols;
+			if (!complete[microbiome])
+			{
+				anyMissing = true;
+				continue;
+			}
+			std::copy(raw, raw + cols, row.begin());
+			Metric::precompute(&row[0], cols, info[microbiome]);
+			std::copy(row.begin(), row.end(), &prepared[(size_t)microbiome * cols]);
+		}
+		// input with 0 in the missing cells, only kept if there are any
+		if (anyMissing)
+		{
+			filled.resize((size_t)rows * cols);
+			for (int microbiome = 0; microbiome < rows; microbiome++)
+			{
+				const double *raw = input + (size_t)microbiome * stride;
+				for (int i = 0; i < cols; i++)
+				{
+					filled[(size_t)microbiome * cols + i] = raw[i] == raw[i] ? raw[i] : 0.0;
+				}
+			}
+		}
+		Sum = SelectSumKernel<T, Acc, Term>(cols);
+		Permute = SelectPermuteKernel<T, Acc, Term>(cols);
+	}
+
+	int rows() const
+	{
+		return numberOfRows;
+	}
+
+	int cols() const
+	{
+		return numberOfColumns;
+	}
+
+	// Metric value of rows a and b; NaN if they share fewer than two cells
+	double statistic(int a, int b, Scratch &scratch) const
+	{
+		if (complete[a] && complete[b])
+		{
+			return Metric::statistic(Sum(row(a), row(b), numberOfColumns), info[a], info[b]);
+		}
+		scratch.intersect(mask(a), mask(b), numberOfColumns);
+		return MaskedStatistic<T, Acc>(Metric(), scratch, filledRow(a), filledRow(b), numberOfColumns);
+	}
+
+	// A pair ready for its permutation test: the rows to shuffle, the kernel
+	// for their length and the observed threshold. For a pair with missing
+	// cells X and Y point into the Scratch the pair was prepared with, until
+	// keep() copies them.
+	struct PermutationSetup
+	{
+		const T *X = NULL;
+		const T *Y = NULL;
+		int n = 0;
+		typename Kernels<T>::Permute PermutePair = NULL;
+		double Threshold = 0.0;
+		bool gathered = false;
+		std::vector<T> ownX, ownY;
+
+		// Take a copy of gathered rows, so the setup outlives the Scratch
+		void keep()
+		{
+			if (gathered && X != ownX.data())
+			{
+				ownX.assign(X, X + n);
+				ownY.assign(Y, Y + n);
+				X = ownX.data();
+				Y = ownY.data();
+			}
+		}
+	};
+
+	// Set up the permutation test of rows a and b, computing the observed sum
+	// once; false if the rows share fewer than two cells
+	bool prepare(int a, int b, Scratch &scratch, PermutationSetup &setup) const
+	{
+		if (complete[a] && complete[b])
+		{
+			setup.X = row(a);
+			setup.Y = row(b);
+			setup.n = numberOfColumns;
+			setup.PermutePair = Permute;
+			setup.Threshold = Term::threshold(Sum(setup.X, setup.Y, setup.n));
+			setup.gathered = false;
+			return true;
+		}
+		int n = scratch.intersect(mask(a), mask(b), numberOfColumns);
+		if (n < 2)
+		{
+			return false;
+		}
+		scratch.gather(filledRow(a), filledRow(b), numberOfColumns);
+		setup.X = &scratch.X[0];
+		setup.Y = &scratch.Y[0];
+		setup.n = n;
+		setup.PermutePair = SelectPermuteKernel<T, Acc, Term>(n);
+		setup.Threshold = Term::threshold(SelectSumKernel<T, Acc, Term>(n)(setup.X, setup.Y, n));
+		setup.gathered = true;
+		return true;
+	}
+
+	// Shuffle the prepared pair's second row MaxPerm times and count how often
+	// the sum is at least as extreme as the observed one. Progress is added to
+	// counters (if any) as it goes. If cancel is given and becomes true, the
+	// shuffling stops at the next chunk and the result is -1.
+	static long permute(const PermutationSetup &setup, long MaxPerm, std::mt19937 &RNG, ThreadCounters *counters = NULL,
+						const std::atomic<bool> *cancel = NULL)
+	{
+		long NExtreme = 0;
+		for (long done = 0; done < MaxPerm; done += kPermutationChunk)
+		{
+			if (cancel && cancel->load(std::memory_order_relaxed))
+			{
+				return -1;
+			}
+			long chunk = std::min(kPermutationChunk, MaxPerm - done);
+			NExtreme += setup.PermutePair(setup.X, setup.Y, setup.n, chunk, setup.Threshold, RNG);
+			if (counters)
+			{
+				counters->addPermutations(chunk);
+			}
+		}
+		return NExtreme;
+	}
+
+	// Shuffle row b MaxPerm times and count how often the sum against row a is
+	// at least as extreme as the observed one; -1 if the rows share fewer than
+	// two cells or cancel was set (see above)
+	long permute(int a, int b, long MaxPerm, std::mt19937 &RNG, Scratch &scratch, ThreadCounters *counters = NULL,
+				 const std::atomic<bool> *cancel = NULL) const
+	{
+		PermutationSetup setup;
+		if (!prepare(a, b, scratch, setup))
+		{
+			if (counters)
+			{
+				counters->addPermutations(MaxPerm);
+			}
+			return -1;
+		}
+		return permute(setup, MaxPerm, RNG, counters, cancel);
+	}
+
+	// p-value of a pair from permute(); NaN if it could not be tested or was
+	// cancelled
+	double pValue(int a, int b, long MaxPerm, std::mt19937 &RNG, Scratch &scratch, ThreadCounters *counters = NULL,
+				  const std::atomic<bool> *cancel = NULL) const
+	{
+		long NExtreme = permute(a, b, MaxPerm, RNG, scratch, counters, cancel);
+		return NExtreme < 0 ? NAN : (double)NExtreme / MaxPerm;
+	}
+
+private:
+	const T *row(int r) const
+	{
+		return &prepared[(size_t)r * numberOfColumns];
+	}
+	const uint64_t *mask(int r) const
+	{
+		return &valid[(size_t)r * words];
+	}
+	const double *filledRow(int r) const
+	{
+		return filled.empty() ? input + (size_t)r * stride : &filled[(size_t)r * numberOfColumns];
+	}
+
+	const double *input;
+	long stride;
+	int numberOfRows;
+	int numberOfColumns;
+	int words;
+	std::vector<uint64_t> valid;
+	std::vector<char> complete;
+	std::vector<double> filled;
+	std::vector<T> prepared;
+	std::vector<RowInfo> info;
+	typename Kernels<T>::Sum Sum;
+	typename Kernels<T>::Permute Permute;
+};
+
+// Pair (a, b) at position index of the packed order (0,1), (0,2), ...
+inline void PairAt(size_t index, int rows, int &a, int &b)
+{
+	a = 0;
+	size_t rowPairs = rows - 1;
+	while (index >= rowPairs)
+	{
+		index -= rowPairs;
+		a++;
+		rowPairs--;
+	}
+	b = a + 1 + (int)index;
+}
+
+// Random stream of permutation chunk chunk of pair (a, b). It depends only on
+// the seed, the pair and the chunk, so p-values do not depend on how many
+// workers there are or which of them runs the chunk.
+inline void SeedChunk(std::mt19937 &RNG, unsigned Seed, int a, int b, long chunk)
+{
+	std::seed_seq sequence{Seed, (unsigned)a, (unsigned)b, (unsigned)chunk};
+	RNG.seed(sequence);
+}
+
+// Run body(worker, first, last) on the tiles of at most tile items that make up
+// [first, last). A task holding more than one tile spawns its upper half and
+// keeps the lower one, so a worker's deque holds a few ranges rather than a
+// task per tile, and whatever a tile spawns is popped (newest first) before the
+// next range.
+template <class Body>
+void RunTiles(WorkStealingScheduler &scheduler, int worker, long first, long last, long tile, const Body &body)
+{
+	while (last - first > tile)
+	{
+		long middle = first + (last - first + tile - 1) / tile / 2 * tile;
+		scheduler.spawn(worker, [&scheduler, middle, last, tile, &body](int thief) { RunTiles(scheduler, thief, middle, last, tile, body); });
+		last = middle;
+	}
+	body(worker, first, last);
+}
+
+// CorrelationPairs() on a work-stealing scheduler. Pairs are split into tiles
+// by RunTiles(), one starting range per worker; a pair whose permutation
+// budget spans several kPermutationChunk chunks is prepared once and pushes
+// all but the first chunk as tasks of their own, which idle workers steal.
+// Worker i counts its work in slot i of stats.
+template <class Metric, class T, class Acc>
+void CorrelationPairsParallel(const PairEngine<Metric, T, Acc> &engine, long MaxPerm, unsigned Seed, double *values, double *pValues, Stats *stats,
+							  int threads)
+{
+	int rows = engine.rows();
+	long pairs = (long)rows * (rows - 1) / 2;
+	WorkStealingScheduler scheduler(threads);
+	std::vector<typename PairEngine<Metric, T, Acc>::Scratch> scratch(scheduler.size());
+	auto counters = [&](int worker) { return (stats && worker < stats->threads()) ? &stats->counters(worker) : (ThreadCounters *)NULL; };
+
+	//--------------------------------------------------------------------------------
+	// Regular credit
+	// calculate the metric for every pair, one tile per task
+
+	if (stats)
+	{
+		stats->expect(kPhaseCorrelate, pairs);
+	}
+	{
+		PhaseTimer timer(stats, kPhaseCorrelate);
+		try
+		{
+			for (long first = 0; first < pairs; first += kPairTile)
+			{
+				scheduler.submit([&, first](int worker) {
+					long last = std::min(first + kPairTile, pairs);
+					int a, b;
+					PairAt(first, rows, a, b);
+					for (long cell = first; cell < last; cell++)
+					{
+						values[cell] = engine.statistic(a, b, scratch[worker]);
+						if (++b == rows)
+						{
+							a++;
+							b = a + 1;
+						}
+					}
+					if (ThreadCounters *slot = counters(worker))
+					{
+						slot->addPairs(last - first);
+					}
+				});
+			}
+		}
+		catch (...)
+		{
+			// queued tiles use the locals of this function
+			scheduler.cancel();
+			throw;
+		}
+		scheduler.wait();
+	}
+
+	//--------------------------------------------------------------------------------
+	// Extra credit
+	// p-values, from one random stream per pair and chunk
+
+	if (MaxPerm <= 0 || !pValues)
+	{
+		return;
+	}
+	if (stats)
+	{
+		stats->expect(kPhasePermute, pairs * MaxPerm);
+	}
+	PhaseTimer timer(stats, kPhasePermute);
+	typedef typename PairEngine<Metric, T, Acc>::PermutationSetup Setup;
+	long chunks = (MaxPerm + kPermutationChunk - 1) / kPermutationChunk;
+	long tile = std::max(1L, kPermutationChunk / MaxPerm);
+	std::vector<std::atomic<long>> extreme(pairs);
+	std::vector<Setup> setups(scheduler.size());
+	auto runChunk = [&](int worker, const Setup &setup, int a, int b, long cell, long chunk) {
+		std::mt19937 RNG;
+		SeedChunk(RNG, Seed, a, b, chunk);
+		long length = std::min(kPermutationChunk, MaxPerm - chunk * kPermutationChunk);
+		extreme[cell] += engine.permute(setup, length, RNG, counters(worker));
+	};
+	auto permuteTile = [&](int worker, long first, long last) {
+		Setup &setup = setups[worker];
+		int a, b;
+		PairAt(first, rows, a, b);
+		for (long cell = first; cell < last; cell++)
+		{
+			if (!engine.prepare(a, b, scratch[worker], setup))
+			{
+				// fewer than two shared cells, nothing to shuffle
+				pValues[cell] = NAN;
+				if (ThreadCounters *slot = counters(worker))
+				{
+					slot->addPermutations(MaxPerm);
+				}
+			}
+			else
+			{
+				pValues[cell] = 0.0;
+				if (chunks > 1)
+				{
+					// the chunks share one copy of the prepared pair
+					std::shared_ptr<Setup> shared(new Setup(setup));
+					shared->keep();
+					for (long chunk = chunks - 1; chunk >= 1; chunk--)
+					{
+						scheduler.spawn(worker, [&, shared, a, b, cell, chunk](int thief) { runChunk(thief, *shared, a, b, cell, chunk); });
+					}
+				}
+				runChunk(worker, setup, a, b, cell, 0);
+			}
+			if (++b == rows)
+			{
+				a++;
+				b = a + 1;
+			}
+		}
+	};
+	try
+	{
+		for (int root = 0; root < scheduler.size(); root++)
+		{
+			long first = pairs * root / scheduler.size();
+			long last = pairs * (root + 1) / scheduler.size();
+			if (first < last)
+			{
+				scheduler.submit([&, first, last](int worker) { RunTiles(scheduler, worker, first, last, tile, permuteTile); });
+			}
+		}
+	}
+	catch (...)
+	{
+		scheduler.cancel();
+		throw;
+	}
+	scheduler.wait();
+	for (long cell = 0; cell < pairs; cell++)
+	{
+		if (pValues[cell] == pValues[cell])
+		{
+			pValues[cell] = (double)extreme[cell] / MaxPerm;
+		}
+	}
+}
+
+// Metric values of all pairs a < b, and if pValues is given their
+// permutation p-values, packed row by row into rows * (rows - 1) / 2 entries
+// each: (0,1), (0,2), ..., (0,rows-1), (1,2), ... Rows are preprocessed in
+// double and stored as T; sums are accumulated in Acc. Pairs whose rows share
+// fewer than two non-missing cells come out NaN. If stats is given, the phases
+// are timed and the work is counted in its first slot.
+//
+// With threads != 1 (0: one per CPU) the pairs run on a work-stealing
+// scheduler, and the p-values come from one random stream per pair and chunk
+// (SeedChunk), so they are the same for any number of threads. One thread runs
+// all pairs in order on a single stream seeded with Seed.
+template <class Metric, class T, class Acc>
+void CorrelationPairs(const double *input, int rows, int cols, long stride, long MaxPerm, unsigned Seed, double *values, double *pValues, Stats *stats = NULL,
+					  int threads = 1)
+{
+	ThreadCounters *counters = stats ? &stats->counters(0) : NULL;
+	long pairs = (long)rows * (rows - 1) / 2;
+	PairEngine<Metric, T, Acc> engine(input, rows, cols, stride, stats);
+	if (threads != 1)
+	{
+		CorrelationPairsParallel(engine, MaxPerm, Seed, values, pValues, stats, threads);
+		return;
+	}
+	typename PairEngine<Metric, T, Acc>::Scratch scratch;
+
+	//--------------------------------------------------------------------------------
+	// Regular credit
+	// calculate the metric for every pair
+
+	if (stats)
+	{
+		stats->expect(kPhaseCorrelate, pairs);
+	}
+	{
+		PhaseTimer timer(stats, kPhaseCorrelate);
+		size_t cell = 0;
+		for (int microbiomeVertical = 0; microbiomeVertical < rows; microbiomeVertical++)
+		{
+			for (int microbiomeHorizontal = microbiomeVertical + 1; microbiomeHorizontal < rows; microbiomeHorizontal++)
+			{
+				values[cell++] = engine.statistic(microbiomeVertical, microbiomeHorizontal, scratch);
+			}
+			if (counters)
+			{
+				counters->addPairs(rows - 1 - microbiomeVertical);
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------------
+	// Extra credit
+	// p-values from shuffling one row of each pair
+
+	if (MaxPerm <= 0 || !pValues)
+	{
+		return;
+	}
+	if (stats)
+	{
+		stats->expect(kPhasePermute, pairs * MaxPerm);
+	}
+	PhaseTimer timer(stats, kPhasePermute);
+	std::mt19937 RNG(Seed);
+	size_t cell = 0;
+	for (int microbiomeVertical = 0; microbiomeVertical < rows; microbiomeVertical++)
+	{
+		for (int microbiomeHorizontal = microbiomeVertical + 1; microbiomeHorizontal < rows; microbiomeHorizontal++)
+		{
+			pValues[cell++] = engine.pValue(microbiomeVertical, microbiomeHorizontal, MaxPerm, RNG, scratch, counters);
+		}
+	}
+}
+
+// Call f(Metric(), T(), Acc()) with the metric named by metric and the storage
+// and accumulator types named by precision: "double", "float" (float storage
+// and sums) or "mixed" (float storage, double sums). False if either is unknown.
+template <class F>
+bool WithConfiguration(const std::string &metric, const std::string &precision, F f)
+{
+	bool known = true;
+	bool found = WithMetric(metric, [&](auto m) {
+		if (precision == "double")
+		{
+			f(m, double(), double());
+		}
+		else if (precision == "float")
+		{
+			f(m, float(), float());
+		}
+		else if (precision == "mixed")
+		{
+			f(m, float(), double());
+		}
+		else
+		{
+			known = false;
+		}
+	});
+	return found && known;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef SYMMAT_KERNELS_H
+#define SYMMAT_KERNELS_H
+
+// Pairwise sum and permutation kernels.
+//
+// Every similarity metric is computed from a sum over the elements of two
+// preprocessed rows: a dot product (rows standardized for Pearson, normalized
+// for cosine, ...) or an L1 distance (Bray-Curtis). Term picks the summand and
+// which permuted sums count as extreme. For row lengths up to kMaxFixedLength
+// a kernel with the length baked in at compile time is picked from a dispatch
+// table once the table is loaded; longer rows use the generic loops.
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <utility>
+
+#if defined(__clang__)
+#define SYMMAT_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define SYMMAT_UNROLL _Pragma("GCC unroll 128")
+#else
+#define SYMMAT_UNROLL
+#endif
+
+// Longest row that gets its own compile-time kernel
+const int kMaxFixedLength = 64;
+
+// Kernel signatures for rows stored as T. Sums are returned as double whatever
+// the accumulator; Threshold is compared in the accumulator type.
+template <class T>
+struct Kernels
+{
+	typedef double (*Sum)(const T *X, const T *Y, int n);
+	typedef long (*Permute)(const T *X, const T *Y, int n, long MaxPerm, double Threshold, std::mt19937 &RNG);
+};
+
+// Dot product. A permuted sum is extreme if its magnitude reaches the observed
+// one (two-tailed).
+struct DotTerm
+{
+	static const char *tail() { return "two-tail"; }
+	template <class Acc>
+	static Acc term(Acc x, Acc y)
+	{
+		return x * y;
+	}
+	template <class Acc>
+	static bool extreme(Acc sum, Acc threshold)
+	{
+		return std::fabs(sum) >= threshold;
+	}
+	static double threshold(double observed)
+	{
+		return std::fabs(observed);
+	}
+};
+
+// Dot product for measures that only grow with the overlap of the rows. A
+// permuted sum is extreme if it reaches the observed one (one-tailed, upper).
+struct UpperDotTerm
+{
+	static const char *tail() { return "one-tail (upper)"; }
+	template <class Acc>
+	static Acc term(Acc x, Acc y)
+	{
+		return x * y;
+	}
+	template <class Acc>
+	static bool extreme(Acc sum, Acc threshold)
+	{
+		return sum >= threshold;
+	}
+	static double threshold(double observed)
+	{
+		return observed;
+	}
+};
+
+// L1 distance. A permuted sum is extreme if the rows come out at least as close
+// as observed (one-tailed, lower).
+struct L1Term
+{
+	static const char *tail() { return "one-tail (lower)"; }
+	template <class Acc>
+	static Acc term(Acc x, Acc y)
+	{
+		return std::fabs(x - y);
+	}
+	template <class Acc>
+	static bool extreme(Acc sum, Acc threshold)
+	{
+		return sum <= threshold;
+	}
+	static double threshold(double observed)
+	{
+		return observed;
+	}
+};
+
+// Shift the row to mean 0 and scale it to sum of squares 1. A constant row is
+// left all zero, so every coefficient involving it comes out as 0 (tested on
+// the values themselves, since centering leaves rounding noise behind).
+inline void Standardize(double X[], int n)
+{
+	bool Constant = true;
+	double Sum = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		Sum += X[i];
+		Constant = Constant && X[i] == X[0];
+	}
+	if (Constant)
+	{
+		for (int i = 0; i < n; ++i)
+		{
+			X[i] = 0.0;
+		}
+		return;
+	}
+	double Mean = Sum / n;
+	double SumSq = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		X[i] -= Mean;
+		SumSq += X[i] * X[i];
+	}
+	double Scale = SumSq > 0.0 ? 1.0 / sqrt(SumSq) : 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		X[i] *= Scale;
+	}
+}
+
+// Pearson coefficient straight from the raw rows, no standardization needed
+inline double Pearson(const double X[], const double Y[], int rows)
+{
+
+	double SumX = 0.0, SumY = 0.0;
+	for (int i = 0; i < rows; ++i)
+	{
+		SumX += X[i];
+		SumY += Y[i];
+	}
+	double MeanX = SumX / rows;
+	double MeanY = SumY / rows;
+	SumX = 0.0;
+	SumY = 0.0;
+	for (int i = 0; i < rows; ++i)
+	{
+		SumX += (X[i] - MeanX) * (X[i] - MeanX);
+		SumY += (Y[i] - MeanY) * (Y[i] - MeanY);
+	}
+	double SigmaX = std::sqrt(SumX);
+	double SigmaY = std::sqrt(SumY);
+
+	// calculate covariance:
+	double Cov = 0.0;
+	for (int i = 0; i < rows; ++i)
+	{
+		Cov += (X[i] - MeanX) * (Y[i] - MeanY);
+	}
+	// return correlation coefficient
+	return Cov / SigmaX / SigmaY;
+}
+
+// Uniform integer in [0, Range) from one 32-bit draw (multiply-shift instead of
+// a division)
+inline uint32_t BoundedRandom(std::mt19937 &RNG, uint32_t Range)
+{
+	return (uint32_t)(((uint64_t)RNG() * Range) >> 32);
+}
+
+//--------------------------------------------------------------------------------
+// Generic kernels, any row length. T is the storage type, Acc the type the
+// sums are accumulated in.
+
+template <class T, class Acc, class Term>
+double SumGeneric(const T *X, const T *Y, int n)
+{
+	Acc Sum = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		Sum += Term::term((Acc)X[i], (Acc)Y[i]);
+	}
+	return Sum;
+}
+
+// Count how many of MaxPerm Fisher-Yates shuffles of Y give a sum against X at
+// least as extreme as Threshold
+template <class T, class Acc, class Term>
+long PermuteGeneric(const T *X, const T *Y, int n, long MaxPerm, double Threshold, std::mt19937 &RNG)
+{
+	T *Yshuffled = new T[n];
+	for (int i = 0; i < n; ++i)
+	{
+		Yshuffled[i] = Y[i];
+	}
+	Acc Limit = (Acc)Threshold;
+	long NExtreme = 0;
+	for (long p = 0; p < MaxPerm; ++p)
+	{
+		for (int i = n - 1; i > 0; --i)
+		{
+			uint32_t j = BoundedRandom(RNG, i + 1);
+			T Temp = Yshuffled[i];
+			Yshuffled[i] = Yshuffled[j];
+			Yshuffled[j] = Temp;
+		}
+		Acc Sum = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			Sum += Term::term((Acc)X[i], (Acc)Yshuffled[i]);
+		}
+		if (Term::extreme(Sum, Limit))
+		{
+			++NExtreme;
+		}
+	}
+	delete[] Yshuffled;
+	return NExtreme;
+}
+
+//--------------------------------------------------------------------------------
+// Fixed-length kernels. N is a compile-time constant, so the loops are fully
+// unrolled and the shuffled row lives in a stack array. The sum is kept in
+// four partial sums so the unrolled body can be vectorized.
+
+template <class T, class Acc, class Term, int N>
+inline Acc SumUnrolled(const T *X, const T *Y)
+{
+	Acc Sum[4] = {0, 0, 0, 0};
+	SYMMAT_UNROLL
+	for (int i = 0; i < N; ++i)
+	{
+		Sum[i % 4] += Term::term((Acc)X[i], (Acc)Y[i]);
+	}
+	return (Sum[0] + Sum[1]) + (Sum[2] + Sum[3]);
+}
+
+template <class T, class Acc, class Term, int N>
+double SumFixed(const T *X, const T *Y, int)
+{
+	return SumUnrolled<T, Acc, Term, N>(X, Y);
+}
+
+template <class T, class Acc, class Term, int N>
+long PermuteFixed(const T *X, const T *Y, int, long MaxPerm, double Threshold, std::mt19937 &RNG)
+{
+	T Xlocal[N], Yshuffled[N];
+	SYMMAT_UNROLL
+	for (int i = 0; i < N; ++i)
+	{
+		Xlocal[i] = X[i];
+		Yshuffled[i] = Y[i];
+	}
+	Acc Limit = (Acc)Threshold;
+	long NExtreme = 0;
+	for (long p = 0; p < MaxPerm; ++p)
+	{
+		SYMMAT_UNROLL
+		for (int i = N - 1; i > 0; --i)
+		{
+			uint32_t j = BoundedRandom(RNG, i + 1);
+			T Temp = Yshuffled[i];
+			Yshuffled[i] = Yshuffled[j];
+			Yshuffled[j] = Temp;
+		}
+		if (Term::extreme(SumUnrolled<T, Acc, Term, N>(Xlocal, Yshuffled), Limit))
+		{
+			++NExtreme;
+		}
+	}
+	return NExtreme;
+}
+
+//--------------------------------------------------------------------------------
+// Dispatch tables, indexed by row length. Entry 0 is the generic kernel.
+
+template <class T, class Acc, class Term, int... Ns>
+const typename Kernels<T>::Sum *SumTable(std::integer_sequence<int, Ns...>)
+{
+	static const typename Kernels<T>::Sum Table[] = {SumGeneric<T, Acc, Term>, SumFixed<T, Acc, Term, Ns + 1>...};
+	return Table;
+}
+
+template <class T, class Acc, class Term, int... Ns>
+const typename Kernels<T>::Permute *PermuteTable(std::integer_sequence<int, Ns...>)
+{
+	static const typename Kernels<T>::Permute Table[] = {PermuteGeneric<T, Acc, Term>, PermuteFixed<T, Acc, Term, Ns + 1>...};
+	return Table;
+}
+
+template <class T, class Acc, class Term>
+typename Kernels<T>::Sum SelectSumKernel(int n)
+{
+	const typename Kernels<T>::Sum *Table = SumTable<T, Acc, Term>(std::make_integer_sequence<int, kMaxFixedLength>());
+	return (n >= 1 && n <= kMaxFixedLength) ? Table[n] : Table[0];
+}
+
+template <class T, class Acc, class Term>
+typename Kernels<T>::Permute SelectPermuteKernel(int n)
+{
+	const typename Kernels<T>::Permute *Table = PermuteTable<T, Acc, Term>(std::make_integer_sequence<int, kMaxFixedLength>());
+	return (n >= 1 && n <= kMaxFixedLength) ? Table[n] : Table[0];
+}
+
+#endif
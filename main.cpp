@@ -1,282 +1,354 @@
+// Command line front end of the symmat library (symmat.h): reads a table,
+// runs the all-pairs table or the approximate search and prints the result,
+// or does the same for every table of a batch (batch.h), or keeps the table
+// resident and answers queries on a socket (server.h).
+//
+// Build from the repository root:
+//
+//	g++ -O2 -pthread main.cpp symmat.cpp -o symmat
+
 #include <iostream>
 #include <fstream>
 #include <cmath>
 #include <string>
-#include <random>
-#include <regex>
-#include <cctype>
-#include <iterator>
 #include <algorithm>
 #include <iomanip>
+#include <vector>
+#include <ctime>
+#include <chrono>
+#include <thread>
 
-using namespace std;
-
-int countLinesInFile(char *filename)
-{
-	std::ifstream inFile(filename);
-	int count = std::count(std::istreambuf_iterator<char>(inFile),
-						   std::istreambuf_iterator<char>(), '\n');
-	cout << "countLinesInFile() " << count << endl;
-	return count;
-}
+#include "batch.h"
+#include "report.h"
+#include "server.h"
+#include "stats.h"
+#include "symmat.h"
+#include "table.h"
 
-int countWords(std::string str)
-{
-	std::regex re("\\S+"); // or `[^ \t\n]+` to exactly match the question
-	return std::distance(
-		std::sregex_iterator(str.begin(), str.end(), re),
-		std::sregex_iterator());
-}
+using namespace std;
 
-int countColumnsInFile(char *filename)
+// --batch: every table of source, one report file each; the exit status is 1
+// if any table failed
+int runBatch(const std::string &source, const std::vector<char *> &positional, symmat::Options options, BatchOptions batch, bool approxMode,
+			 const symmat::StrongPairOptions &approx, double progressInterval, const std::string &statsFile)
 {
-
-	std::ifstream inFile(filename);
-	if (inFile.good())
+	std::vector<std::string> inputs;
+	if (!listBatchInputs(source, inputs))
 	{
-		string sLine;
-		getline(inFile, sLine);
-		int words = countWords(sLine);
-		cout << "countColumnsInFile() " << words << endl;
-		return words;
+		cout << "Cannot read \"" << source << "\"\n";
+		return 1;
 	}
-	else
+	if (!positional.empty())
 	{
-		exit(-1);
+		options.permutations = atol(positional[0]);
+	}
+	batch.approxMode = approxMode;
+	batch.approx = approx;
+	if (batch.threads <= 0)
+	{
+		batch.threads = std::max(1, (int)std::thread::hardware_concurrency());
 	}
-}
 
-void printArray(string prefix, double A[], int cells)
-{
+	Stats stats(batch.threads);
+	auto start = std::chrono::steady_clock::now();
+	int failed = RunBatch(inputs, options, batch, &stats, progressInterval > 0 ? &cerr : NULL);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	cout << "Batch: " << inputs.size() - failed << " of " << inputs.size() << " tables written to " << batch.outputDir << " in " << seconds
+		 << " s on " << batch.threads << " threads\n";
 
-	cout << prefix << "\t";
-	for (int i = 0; i < cells; i++)
+	if (!statsFile.empty())
 	{
-		cout << A[i] << "\t";
+		stats.set("tables", inputs.size());
+		stats.set("failedTables", failed);
+		stats.set("threadCount", batch.threads);
+		stats.set("wallSeconds", seconds);
+		stats.set("maxPermutations", options.permutations);
+		if (!stats.writeJson(statsFile))
+		{
+			cout << "Cannot write file \"" << statsFile << "\"\n";
+			return 1;
+		}
 	}
-	cout << "\n";
+	return failed > 0 ? 1 : 0;
 }
 
-double Pearson(double X[], double Y[], int rows)
+// --serve: preprocess the table once, then answer queries on socketPath until
+// SIGINT or SIGTERM
+int runServer(const std::string &socketPath, const Table &table, const symmat::Matrix &matrix, const symmat::Options &options, int threads,
+			  long maxPermutations, double progressInterval, Stats &stats, const std::string &statsFile)
 {
-
-	double SumX = 0.0, SumY = 0.0;
-	for (int i = 0; i < rows; ++i)
+	symmat::Engine engine;
+	std::string error;
+	if (!engine.load(matrix, options, &error))
 	{
-		SumX += X[i];
-		SumY += Y[i];
+		cout << "Cannot load the table: " << error << "\n";
+		return 1;
 	}
-	double MeanX = SumX / rows;
-	double MeanY = SumY / rows;
-	SumX = 0.0;
-	SumY = 0.0;
-	for (int i = 0; i < rows; ++i)
+	stats.stopProgress();
+	ThreadPool pool(threads);
+	Server server(engine, table, options, pool, maxPermutations);
+	cout << "Serving " << table.rows << " rows on " << socketPath << " with " << pool.size() << " threads" << endl;
+	if (!server.serve(socketPath, error, progressInterval > 0 ? &cerr : NULL))
 	{
-		SumX += (X[i] - MeanX) * (X[i] - MeanX);
-		SumY += (Y[i] - MeanY) * (Y[i] - MeanY);
+		cout << "Cannot serve on \"" << socketPath << "\": " << error << "\n";
+		return 1;
 	}
-	double SigmaX = sqrt(SumX);
-	double SigmaY = sqrt(SumY);
+	cout << "Stopped\n";
 
-	// calculate covariance:
-	double Cov = 0.0;
-	for (int i = 0; i < rows; ++i)
+	if (!statsFile.empty())
 	{
-		Cov += (X[i] - MeanX) * (Y[i] - MeanY);
+		stats.set("rows", table.rows);
+		stats.set("columns", table.cols);
+		stats.set("threadCount", pool.size());
+		if (!stats.writeJson(statsFile))
+		{
+			cout << "Cannot write file \"" << statsFile << "\"\n";
+			return 1;
+		}
 	}
-	// return correlation coefficient
-	return Cov / SigmaX / SigmaY;
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
 
 	std::cout << std::setprecision(6);
-	if (argc < 2)
+
+	symmat::Options options;
+	options.permutations = 1000000;
+	options.seed = time(0);
+	bool validate = false;
+	bool approxMode = false;
+	symmat::StrongPairOptions approx;
+	double progressInterval = 5.0;
+	std::string statsFile;
+	std::string batchSource;
+	BatchOptions batch;
+	std::string socketPath;
+	long maxPermutations = kServerMaxPermutations;
+	// -1: not given (one thread for a single table, one per core otherwise)
+	int threads = -1;
+	std::vector<char *> positional;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		if (arg == "--precision" && i + 1 < argc)
+		{
+			options.precision = argv[++i];
+		}
+		else if (arg == "--seed" && i + 1 < argc)
+		{
+			options.seed = strtoul(argv[++i], NULL, 10);
+		}
+		else if (arg == "--metric" && i + 1 < argc)
+		{
+			options.metric = argv[++i];
+		}
+		else if (arg == "--progress" && i + 1 < argc)
+		{
+			progressInterval = atof(argv[++i]);
+		}
+		else if (arg == "--stats-json" && i + 1 < argc)
+		{
+			statsFile = argv[++i];
+		}
+		else if (arg == "--approx" && i + 1 < argc)
+		{
+			approxMode = true;
+			approx.minR = atof(argv[++i]);
+		}
+		else if (arg == "--lsh-bits" && i + 1 < argc)
+		{
+			approx.bits = atoi(argv[++i]);
+		}
+		else if (arg == "--lsh-tables" && i + 1 < argc)
+		{
+			approx.tables = atoi(argv[++i]);
+		}
+		else if (arg == "--recall-sample" && i + 1 < argc)
+		{
+			approx.recallSample = atol(argv[++i]);
+		}
+		else if (arg == "--batch" && i + 1 < argc)
+		{
+			batchSource = argv[++i];
+		}
+		else if (arg == "--output-dir" && i + 1 < argc)
+		{
+			batch.outputDir = argv[++i];
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else if (arg == "--prefetch" && i + 1 < argc)
+		{
+			batch.prefetch = atoi(argv[++i]);
+		}
+		else if (arg == "--serve" && i + 1 < argc)
+		{
+			socketPath = argv[++i];
+		}
+		else if (arg == "--max-permutations" && i + 1 < argc)
+		{
+			maxPermutations = atol(argv[++i]);
+		}
+		else if (arg == "--validate")
+		{
+			validate = true;
+		}
+		else
+		{
+			positional.push_back(argv[i]);
+		}
+	}
+
+	if (!batchSource.empty())
 	{
-		cout << "Use as:  " << argv[0] << " <InputFile>\n";
-		cout << "Example: " << argv[0] << " Table.txt\n";
+		batch.threads = threads;
+		return runBatch(batchSource, positional, options, batch, approxMode, approx, progressInterval, statsFile);
+	}
+
+	if (positional.empty())
+	{
+		cout << "Use as:  " << argv[0] << " [options] <InputFile> [<Max permutations>]\n";
+		cout << "         " << argv[0] << " [options] --batch <directory|list file> [<Max permutations>]\n";
+		cout << "         " << argv[0] << " [options] --serve <socket> <InputFile> [<Max permutations>]\n";
+		cout << "Example: " << argv[0] << " Table.txt 1000000\n";
+		cout << "Options:\n";
+		cout << "  --metric <name>                 pearson, cosine, jaccard, bray-curtis or rho (default pearson)\n";
+		cout << "  --precision double|float|mixed  storage/accumulator precision (default double)\n";
+		cout << "  --validate                      also run in double and compare r and p\n";
+		cout << "  --seed <n>                      random seed (default: current time)\n";
+		cout << "  --approx <min |r|>              list only pairs with |r| above this, found by SimHash LSH\n";
+		cout << "                                  (pearson or cosine; for tables too large for all pairs)\n";
+		cout << "  --lsh-bits <n>, --lsh-tables <n> SimHash band width and band count (default: automatic)\n";
+		cout << "  --recall-sample <n>             random pairs checked exactly to estimate recall (default 100000)\n";
+		cout << "  --batch <directory|list file>   run every table of a directory, or listed one per line in a file\n";
+		cout << "  --output-dir <directory>        where --batch writes <table file>.out.txt (default .)\n";
+		cout << "  --serve <socket>                keep the table loaded and answer JSON-lines queries on a Unix socket\n";
+		cout << "                                  (see server.h; Max permutations is the default for pair queries)\n";
+		cout << "  --max-permutations <n>          most permutations per pair a --serve query may ask for (default 100000000)\n";
+		cout << "  --threads <n>                   worker threads, 0 = one per core (default 1 for a single table,\n";
+		cout << "                                  one per core for --batch and --serve). For n != 1, a table's pairs are\n";
+		cout << "                                  scheduled by work stealing and p-values come from per-pair random\n";
+		cout << "                                  streams: the same with --seed for any n != 1, on any machine\n";
+		cout << "  --prefetch <n>                  tables --batch parses ahead of the workers (default 2)\n";
+		cout << "  --progress <seconds>            progress line on stderr every so often (default 5, 0 = off)\n";
+		cout << "  --stats-json <file>             write phase timings and throughput counters at exit\n";
 		return 0;
 	}
 
-	ifstream InFile(argv[1]);
+	ifstream InFile(positional[0]);
 	if (!InFile.is_open())
 	{
-		cout << "Cannot open file \"" << argv[1] << "\"\n";
+		cout << "Cannot open file \"" << positional[0] << "\"\n";
 		return 1;
 	}
-	char *filename = argv[1];
+	char *filename = positional[0];
 
-	int numberOfMicrobiomes = countLinesInFile(argv[1]);
-	int numberofBacteria = countColumnsInFile(filename);
+	if (positional.size() >= 2)
+	{
+		options.permutations = atol(positional[1]);
+	}
 
-	double input[numberOfMicrobiomes][numberofBacteria];
+	// 0 is passed on as is: the engine picks the core count itself and, unlike
+	// an explicit 1, uses the per-pair random streams, so a command line gives
+	// the same p-values on any machine
+	options.threads = threads < 0 ? 1 : threads;
+	int workerCount = options.threads > 0 ? options.threads : std::max(1, (int)std::thread::hardware_concurrency());
+	Stats stats(workerCount);
+	stats.startProgress(progressInterval, cerr);
 
-	std::string microbiomeName[numberOfMicrobiomes];
-	cout << "numberofBacteria = " << numberofBacteria << "\n";
-	std::string bacteriaName[numberofBacteria];
-	memset(bacteriaName, 0, numberofBacteria);
-	std::ifstream inFile(filename);
-	if (inFile.good())
+	Table table;
 	{
-
-		std::string sLine;
-		int rowNum = 0;
-		while (std::getline(inFile, sLine))
+		PhaseTimer timer(&stats, kPhaseLoad);
+		if (!readTable(filename, table))
 		{
-			std::regex r("\\s+");
-			std::smatch match;
+			cout << "Cannot read file \"" << filename << "\"\n";
+			return 1;
+		}
+	}
+	int numberOfMicrobiomes = table.rows;
+	int numberofBacteria = table.cols;
+	printHeader(cout, table);
 
-			std::sregex_token_iterator iter(sLine.begin(),
-											sLine.end(),
-											r,
-											-1);
-			std::sregex_token_iterator end;
-			int columnNum = 0;
-			for (; iter != end; ++iter)
-			{
-				if (rowNum == 0)
-				{
-					if (columnNum == 0)
-					{
-						bacteriaName[columnNum] = "blank";
-					}
-					else
-					{
-						std::string test = iter->str();
-						bacteriaName[columnNum] = test;
-					}
-				}
-				else
-				{
-					if (columnNum == 0)
-					{
-						microbiomeName[rowNum] = iter->str();
-						// this doesn't contain any useful data
-					}
-					else
-					{
-						std::string value = iter->str();
-						double temp = ::atof(value.c_str());
-						input[rowNum][columnNum] = temp;
-					}
-				}
-				columnNum++;
-			}
-			++rowNum;
+	symmat::Matrix matrix;
+	matrix.data = table.values.data();
+	matrix.rows = numberOfMicrobiomes;
+	matrix.cols = numberofBacteria;
+	options.stats = &stats;
+	if (!socketPath.empty())
+	{
+		return runServer(socketPath, table, matrix, options, threads, maxPermutations, progressInterval, stats, statsFile);
+	}
+	symmat::Result output;
+	std::string error;
+	if (approxMode)
+	{
+		symmat::StrongPairs result;
+		if (!symmat::findStrongPairs(matrix, options, approx, result, &error))
+		{
+			cout << "Cannot run the approximate search: " << error << "\n";
+			return 1;
 		}
+		stats.startPhase(kPhaseWrite);
+		printAssociations(cout, table, result, approx, options.permutations);
 	}
 	else
 	{
-		exit(-1);
+		if (!symmat::correlate(matrix, options, output, &error))
+		{
+			cout << "Cannot correlate \"" << filename << "\": " << error << "\n";
+			return 1;
+		}
+		stats.startPhase(kPhaseWrite);
+		printTable(cout, table, output, options.metric, options.permutations);
 	}
+	cout.flush();
+	stats.stopPhase(kPhaseWrite);
+	stats.stopProgress();
 
-	double output[numberOfMicrobiomes][numberOfMicrobiomes];
-	memset(&output, 0, numberOfMicrobiomes * numberOfMicrobiomes);
-	int deleteThis = 0;
-	for (int microbiomeVertical = 1; microbiomeVertical < numberOfMicrobiomes; microbiomeVertical++)
+	if (!statsFile.empty())
 	{
-
-		for (int microbiomeHorizontal = 1; microbiomeHorizontal < numberOfMicrobiomes; microbiomeHorizontal++)
+		stats.set("rows", numberOfMicrobiomes);
+		stats.set("columns", numberofBacteria);
+		stats.set("maxPermutations", options.permutations);
+		stats.set("threadCount", workerCount);
+		if (!stats.writeJson(statsFile))
 		{
-
-			//--------------------------------------------------------------------------------
-			// Regular credit
-			// calculate the correlation coefficient and insert it into the nxn output array
-
-			if (microbiomeHorizontal > microbiomeVertical)
-			{
-				double pearsonCoeff = Pearson(input[microbiomeVertical], input[microbiomeHorizontal], numberOfMicrobiomes);
-				output[microbiomeVertical][microbiomeHorizontal] = pearsonCoeff;
-				if (pearsonCoeff < -99999999)
-				{
-					printArray("horizontal: ", input[microbiomeVertical], numberOfMicrobiomes);
-					printArray("vertical: ", input[microbiomeHorizontal], numberOfMicrobiomes);
-					cout << "wrong pearsonCoeff: " << pearsonCoeff << "\t(" << microbiomeVertical << "," << microbiomeHorizontal << ")\n";
-					exit(-1);
-				}
-				//				cout << microbiomeHorizontal << "\n";
-				int MaxPerm = 1000000;
-				int NExtreme = 0;
-				for (int i = 0; i < MaxPerm; i++)
-				{
-					// Shuffle one of the arrays
-					double *X = input[microbiomeVertical];
-					double *Y = input[microbiomeHorizontal];
-					double *Yshuffled = Y;
-
-					mt19937 RNG(time(0));
-
-					for (int i = microbiomeHorizontal - 1; i > 0; --i)
-					{
-						int j = RNG() % (i + 1);
-						double Temp = Yshuffled[i];
-						Yshuffled[i] = Yshuffled[j];
-						Yshuffled[j] = Temp;
-					}
-
-					// calculate the correlation coefficient
-					double pearsonCoeffShuffled = Pearson(X, Y, numberOfMicrobiomes);
-
-					if (abs(pearsonCoeffShuffled) > abs(pearsonCoeff))
-					{
-						++NExtreme;
-						// 						cout << ".";
-					}
-				}
-				if (MaxPerm == 0)
-				{
-					cout << "Why is this zero?\n";
-					exit(-1);
-				}
-				if (NExtreme == 0)
-				{
-					// 					cout << microbiomeName[microbiomeVertical] << ": " << NExtreme << " (threshold was " << pearsonCoeff << ")\n";
-				}
-				double ratio = (double)NExtreme / MaxPerm;
-				if (abs(ratio) < 0.0000000000001)
-				{
-					ratio = 0;
-				}
-				else
-				{
-					output[microbiomeHorizontal][microbiomeVertical] = ratio;
-				}
-			}
-			else
-			{
-				// do not duplicate what we've already done
-			}
+			cout << "Cannot write file \"" << statsFile << "\"\n";
+			return 1;
 		}
 	}
 
-	// Print the final table with headings
-	cout << "\t";
-	for (int bacteriaVertical = 1; bacteriaVertical < numberOfMicrobiomes; bacteriaVertical++)
-	{
-		std::string name(microbiomeName[bacteriaVertical]);
-		printf("%7s", name.c_str());
-	}
-	cout << "\n";
-	for (int microbiomeVertical = 1; microbiomeVertical < numberOfMicrobiomes; microbiomeVertical++)
+	// Validation harness: same seed, so the double run sees the same shuffles and
+	// only rounding can move r or flip a borderline permutation.
+	if (validate && !approxMode)
 	{
-		cout << microbiomeName[microbiomeVertical] << "\t";
-		for (int microbiomeHorizontal = 1; microbiomeHorizontal < numberOfMicrobiomes - 1; microbiomeHorizontal++)
+		symmat::Result reference;
+		symmat::Options referenceOptions = options;
+		referenceOptions.precision = "double";
+		referenceOptions.stats = NULL;
+		symmat::correlate(matrix, referenceOptions, reference);
+		double rTolerance = 1e-4;
+		double pTolerance = 1e-3 + (options.permutations > 0 ? 2.0 / options.permutations : 0.0);
+		double rError = 0.0, pError = 0.0;
+		for (size_t cell = 0; cell < output.values.size(); cell++)
 		{
-			double value = output[microbiomeVertical][microbiomeHorizontal];
-			if (microbiomeVertical == microbiomeHorizontal)
-			{
-				printf("%4s\t", "*");
-			}
-			else if (value == 0)
-			{
-				printf("%4d\t", 0);
-			}
-			else
-			{
-				printf("%-.4f\t", value);
-			}
+			rError = max(rError, abs(output.values[cell] - reference.values[cell]));
 		}
-		cout << "\n";
+		for (size_t cell = 0; cell < output.pValues.size(); cell++)
+		{
+			pError = max(pError, abs(output.pValues[cell] - reference.pValues[cell]));
+		}
+		cout << "\nValidation (" << options.precision << " vs double): max |dr| = " << rError << " (tolerance " << rTolerance
+			 << "), max |dp| = " << pError << " (tolerance " << pTolerance << ")\n";
+		if (rError > rTolerance || pError > pTolerance)
+		{
+			cout << "VALIDATION FAILED\n";
+			return 2;
+		}
+		cout << "Validation passed\n";
 	}
-}
\ No newline at end of file
+}
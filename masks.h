@@ -0,0 +1,94 @@
+#ifndef SYMMAT_MASKS_H
+#define SYMMAT_MASKS_H
+
+// Validity bitmaps for rows with missing values: bit i of a row's mask is set
+// if cell i holds a value. A pair is computed over the cells valid in both
+// rows (pairwise-complete); the masks are ANDed a word at a time and counted
+// with popcount, and the sums below are weighted by the mask bits instead of
+// branching on every cell.
+
+#include <cmath>
+#include <cstdint>
+
+inline int MaskWords(int n)
+{
+	return (n + 63) / 64;
+}
+
+// Set the bits of the cells of X that are not NaN; returns how many there are
+inline int BuildMask(const double *X, int n, uint64_t *Mask)
+{
+	int count = 0;
+	for (int word = 0; word < MaskWords(n); word++)
+	{
+		uint64_t bits = 0;
+		for (int bit = 0; bit < 64 && word * 64 + bit < n; bit++)
+		{
+			bits |= (uint64_t)(X[word * 64 + bit] == X[word * 64 + bit]) << bit;
+		}
+		Mask[word] = bits;
+		count += __builtin_popcountll(bits);
+	}
+	return count;
+}
+
+// Out = A & B; returns the number of bits set
+inline int AndMasks(const uint64_t *A, const uint64_t *B, int words, uint64_t *Out)
+{
+	int count = 0;
+	for (int word = 0; word < words; word++)
+	{
+		Out[word] = A[word] & B[word];
+		count += __builtin_popcountll(Out[word]);
+	}
+	return count;
+}
+
+// Copy the cells of X whose bits are set in Mask to the front of Out
+inline void GatherMasked(const double *X, const uint64_t *Mask, int words, double *Out)
+{
+	int count = 0;
+	for (int word = 0; word < words; word++)
+	{
+		for (uint64_t bits = Mask[word]; bits; bits &= bits - 1)
+		{
+			Out[count++] = X[word * 64 + __builtin_ctzll(bits)];
+		}
+	}
+}
+
+// Pearson coefficient over the count cells set in Mask. X and Y must hold 0,
+// not NaN, in their missing cells.
+inline double MaskedPearson(const double *X, const double *Y, const uint64_t *Mask, int n, int count)
+{
+	if (count < 2)
+	{
+		return NAN;
+	}
+	double SumX = 0.0, SumY = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		double w = (double)((Mask[i >> 6] >> (i & 63)) & 1);
+		SumX += w * X[i];
+		SumY += w * Y[i];
+	}
+	double MeanX = SumX / count;
+	double MeanY = SumY / count;
+	double SumXX = 0.0, SumYY = 0.0, Cov = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		double w = (double)((Mask[i >> 6] >> (i & 63)) & 1);
+		double dx = w * (X[i] - MeanX);
+		double dy = w * (Y[i] - MeanY);
+		SumXX += dx * dx;
+		SumYY += dy * dy;
+		Cov += dx * dy;
+	}
+	if (SumXX <= 0.0 || SumYY <= 0.0)
+	{
+		return 0.0;
+	}
+	return Cov / std::sqrt(SumXX) / std::sqrt(SumYY);
+}
+
+#endif
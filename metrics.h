@@ -0,0 +1,199 @@
+#ifndef SYMMAT_METRICS_H
+#define SYMMAT_METRICS_H
+
+// Similarity metrics.
+//
+// A metric is a struct of static members that the table engine is
+// instantiated with, so the inner loops never go through a virtual call:
+//
+//   Term         the summand the pairwise and permutation kernels use and
+//                the tail of the permutation test (DotTerm, UpperDotTerm or
+//                L1Term from kernels.h)
+//   precompute   turns a raw row into what the kernels sum over, in place, and
+//                records the row constants the statistic needs. Shuffling a
+//                row does not change these constants.
+//   statistic    turns the sum for a pair into the reported value
+//
+// For a fixed pair of rows the statistic is monotone in the sum, so the
+// permutation test compares permuted sums directly against the observed sum.
+
+#include <cmath>
+#include <string>
+
+#include "kernels.h"
+
+// Permutation-invariant constants of a preprocessed row
+struct RowInfo
+{
+	double sum = 0.0;
+	double sumSq = 0.0;
+	double count = 0.0;
+};
+
+// Pearson correlation coefficient: rows standardized, r is the dot product
+struct PearsonMetric
+{
+	typedef DotTerm Term;
+	static const char *name() { return "pearson"; }
+	static const char *description() { return "Pearson correlation coefficient"; }
+
+	static void precompute(double X[], int n, RowInfo &)
+	{
+		Standardize(X, n);
+	}
+	static double statistic(double sum, const RowInfo &, const RowInfo &)
+	{
+		return sum;
+	}
+};
+
+// Cosine similarity: rows scaled to unit length, not centered. Two-tailed since
+// rows may have negative entries; on non-negative data no sum is below zero and
+// the test is the upper tail alone.
+struct CosineMetric
+{
+	typedef DotTerm Term;
+	static const char *name() { return "cosine"; }
+	static const char *description() { return "Cosine similarity"; }
+
+	static void precompute(double X[], int n, RowInfo &)
+	{
+		double SumSq = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			SumSq += X[i] * X[i];
+		}
+		double Scale = SumSq > 0.0 ? 1.0 / std::sqrt(SumSq) : 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			X[i] *= Scale;
+		}
+	}
+	static double statistic(double sum, const RowInfo &, const RowInfo &)
+	{
+		return sum;
+	}
+};
+
+// Jaccard index of the present (non-zero) entries: rows turned into 0/1, the
+// dot product counts the entries present in both. Only more overlap than
+// observed is as extreme, so the test is one-tailed towards large values.
+struct JaccardMetric
+{
+	typedef UpperDotTerm Term;
+	static const char *name() { return "jaccard"; }
+	static const char *description() { return "Jaccard index (presence/absence)"; }
+
+	static void precompute(double X[], int n, RowInfo &info)
+	{
+		info.count = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			X[i] = X[i] > 0.0 ? 1.0 : 0.0;
+			info.count += X[i];
+		}
+	}
+	static double statistic(double sum, const RowInfo &x, const RowInfo &y)
+	{
+		double Union = x.count + y.count - sum;
+		return Union > 0.0 ? sum / Union : 0.0;
+	}
+};
+
+// Bray-Curtis dissimilarity: sum |x - y| / sum (x + y). Smaller is more similar,
+// so the permutation test is one-tailed towards small values.
+struct BrayCurtisMetric
+{
+	typedef L1Term Term;
+	static const char *name() { return "bray-curtis"; }
+	static const char *description() { return "Bray-Curtis dissimilarity"; }
+
+	static void precompute(double X[], int n, RowInfo &info)
+	{
+		info.sum = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			info.sum += X[i];
+		}
+	}
+	static double statistic(double sum, const RowInfo &x, const RowInfo &y)
+	{
+		double Total = x.sum + y.sum;
+		return Total > 0.0 ? sum / Total : 0.0;
+	}
+};
+
+// Proportionality rho = 1 - var(clr x - clr y) / (var clr x + var clr y)
+//                     = 2 cov(clr x, clr y) / (var clr x + var clr y)
+// on centered log-ratio rows. Zeros are replaced by half the smallest non-zero
+// value of the row before taking logs.
+struct RhoMetric
+{
+	typedef DotTerm Term;
+	static const char *name() { return "rho"; }
+	static const char *description() { return "Proportionality rho (clr)"; }
+
+	static void precompute(double X[], int n, RowInfo &info)
+	{
+		double Smallest = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (X[i] > 0.0 && (Smallest == 0.0 || X[i] < Smallest))
+			{
+				Smallest = X[i];
+			}
+		}
+		double Pseudo = Smallest > 0.0 ? Smallest / 2 : 1.0;
+		double Sum = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			X[i] = std::log(X[i] > 0.0 ? X[i] : Pseudo);
+			Sum += X[i];
+		}
+		double Mean = Sum / n;
+		info.sumSq = 0.0;
+		for (int i = 0; i < n; ++i)
+		{
+			X[i] -= Mean;
+			info.sumSq += X[i] * X[i];
+		}
+	}
+	static double statistic(double sum, const RowInfo &x, const RowInfo &y)
+	{
+		double Total = x.sumSq + y.sumSq;
+		return Total > 0.0 ? 2 * sum / Total : 0.0;
+	}
+};
+
+// Call f with a value of the metric type named by name; false if there is none
+template <class F>
+bool WithMetric(const std::string &name, F f)
+{
+	if (name == PearsonMetric::name())
+	{
+		f(PearsonMetric());
+	}
+	else if (name == CosineMetric::name())
+	{
+		f(CosineMetric());
+	}
+	else if (name == JaccardMetric::name())
+	{
+		f(JaccardMetric());
+	}
+	else if (name == BrayCurtisMetric::name())
+	{
+		f(BrayCurtisMetric());
+	}
+	else if (name == RhoMetric::name())
+	{
+		f(RhoMetric());
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SYMMAT_REPORT_H
+#define SYMMAT_REPORT_H
+
+// Text reports of a run: the all-pairs table and the strong-pair list, written
+// to any stream so a run can go to stdout or (in batch mode) to its own file.
+
+#include <cstdarg>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "symmat.h"
+#include "table.h"
+
+// printf-style formatting into a string
+inline std::string formatField(const char *format, ...)
+{
+	char buffer[256];
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(buffer, sizeof(buffer), format, arguments);
+	va_end(arguments);
+	return buffer;
+}
+
+// Table dimensions, printed before the run starts
+inline void printHeader(std::ostream &out, const Table &table)
+{
+	out << "numberOfMicrobiomes = " << table.rows << "\n";
+	out << "numberofBacteria = " << table.cols << "\n";
+}
+
+// Print the final table with headings: the metric's values in the upper right
+// triangle, p-values in the lower left one
+inline void printTable(std::ostream &out, const Table &table, const symmat::Result &result, const std::string &metric, long MaxPerm)
+{
+	int numberOfMicrobiomes = table.rows;
+	const std::vector<std::string> &microbiomeName = table.rowNames;
+	out << "\t";
+	for (int bacteriaVertical = 0; bacteriaVertical < numberOfMicrobiomes; bacteriaVertical++)
+	{
+		out << formatField("%7s\t", microbiomeName[bacteriaVertical].c_str());
+	}
+	out << "\n";
+	for (int microbiomeVertical = 0; microbiomeVertical < numberOfMicrobiomes; microbiomeVertical++)
+	{
+		out << microbiomeName[microbiomeVertical] << "\t";
+		for (int microbiomeHorizontal = 0; microbiomeHorizontal < numberOfMicrobiomes; microbiomeHorizontal++)
+		{
+			if (microbiomeVertical == microbiomeHorizontal)
+			{
+				out << formatField("%4s\t", "*");
+				continue;
+			}
+			double value = 0.0;
+			if (microbiomeHorizontal > microbiomeVertical)
+			{
+				value = result.value(microbiomeVertical, microbiomeHorizontal);
+			}
+			else if (!result.pValues.empty())
+			{
+				value = result.pValue(microbiomeVertical, microbiomeHorizontal);
+			}
+			if (value != value)
+			{
+				out << formatField("%4s\t", "NA");
+			}
+			else if (value == 0)
+			{
+				out << formatField("%4d\t", 0);
+			}
+			else
+			{
+				out << formatField("%-.4f\t", value);
+			}
+		}
+		out << "\n";
+	}
+	out << "\nNotes:\n";
+	out << symmat::metricDescription(metric) << " values are shown in the upper right triangle\n";
+	if (MaxPerm > 0)
+	{
+		out << "Lower left triangle shows " << symmat::metricTail(metric) << " p-values from " << MaxPerm << " permutations\n";
+	}
+}
+
+// Print the strong pairs found by the approximate search, strongest first
+inline void printAssociations(std::ostream &out, const Table &table, const symmat::StrongPairs &result, const symmat::StrongPairOptions &approx,
+							  long MaxPerm)
+{
+	out << "Row\tRow\tr\tp\n";
+	for (size_t i = 0; i < result.pairs.size(); i++)
+	{
+		const symmat::StrongPair &pair = result.pairs[i];
+		out << table.rowNames[pair.a] << "\t" << table.rowNames[pair.b] << "\t";
+		out << formatField("%-.4f\t", pair.r);
+		if (pair.p != pair.p)
+		{
+			out << "NA\n";
+		}
+		else
+		{
+			out << formatField("%-.4f\n", pair.p);
+		}
+	}
+	long pairs = (long)table.rows * (table.rows - 1) / 2;
+	out << "\nNotes:\n";
+	out << result.pairs.size() << " pairs with |r| >= " << approx.minR << " among " << result.candidates << " candidate pairs of " << pairs
+		<< " (SimHash, " << result.tables << " bands of " << result.bits << " bits)\n";
+	out << "Expected recall at |r| = " << approx.minR << ": " << result.expectedRecall << "\n";
+	if (result.sampledStrong > 0)
+	{
+		out << "Sampled recall: " << result.sampledFound << " of " << result.sampledStrong << " strong pairs among " << result.sampledPairs
+			<< " sampled pairs were candidates (" << (double)result.sampledFound / result.sampledStrong << ")\n";
+	}
+	else
+	{
+		// at scale strong pairs are far too rare for a uniform sample to hit
+		out << "Sampled recall: not measured, none of the " << result.sampledPairs << " sampled pairs has |r| >= " << approx.minR
+			<< " (raise --recall-sample or rely on the expected recall)\n";
+	}
+	if (MaxPerm > 0)
+	{
+		out << "p-values are two-tail, from " << MaxPerm << " permutations\n";
+	}
+}
+
+#endif
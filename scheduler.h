@@ -0,0 +1,407 @@
+#ifndef SYMMAT_SCHEDULER_H
+#define SYMMAT_SCHEDULER_H
+
+// Work-stealing task scheduler for work whose pieces cost very different
+// amounts (pair tiles next to pairs with a huge permutation budget).
+//
+// Every worker owns a deque. It pushes the tasks it spawns at the back and
+// takes its own work from the back too (newest first, still warm in cache);
+// an idle worker steals from the front of another worker's deque (oldest
+// first, usually the biggest piece left). Victims on the worker's own NUMA
+// node are tried before workers on other nodes.
+//
+// Workers are spread over the NUMA nodes listed in
+// /sys/devices/system/node/node*/cpulist (only CPUs the process may run on are
+// used). Without that topology all CPUs count as one node. A scheduler that
+// owns every allowed CPU (one worker each) pins each worker to its CPU; one
+// with a set worker count shares the machine, e.g. with concurrent runs, and
+// leaves placement to the OS.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Numbers of a sysfs list such as "0-3,8-11"
+inline std::vector<int> parseCpuList(const std::string &list)
+{
+	std::vector<int> cpus;
+	std::stringstream ranges(list);
+	std::string range;
+	while (std::getline(ranges, range, ','))
+	{
+		if (range.empty() || !isdigit((unsigned char)range[0]))
+		{
+			continue;
+		}
+		char *end;
+		long first = strtol(range.c_str(), &end, 10);
+		long last = *end == '-' ? strtol(end + 1, NULL, 10) : first;
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back((int)cpu);
+		}
+	}
+	return cpus;
+}
+
+// The CPUs this process may run on, grouped by NUMA node
+inline std::vector<std::vector<int>> DetectNumaNodes()
+{
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+	std::vector<std::vector<int>> nodes;
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string onlineList;
+	std::getline(online, onlineList);
+	std::vector<int> nodeNumbers = parseCpuList(onlineList);
+	for (size_t n = 0; n < nodeNumbers.size(); n++)
+	{
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(nodeNumbers[n]) + "/cpulist");
+		std::string list;
+		std::getline(file, list);
+		std::vector<int> cpus;
+		std::vector<int> listed = parseCpuList(list);
+		for (size_t i = 0; i < listed.size(); i++)
+		{
+			if (!haveMask || (listed[i] < CPU_SETSIZE && CPU_ISSET(listed[i], &allowed)))
+			{
+				cpus.push_back(listed[i]);
+			}
+		}
+		if (!cpus.empty())
+		{
+			nodes.push_back(cpus);
+		}
+	}
+	if (nodes.empty())
+	{
+		std::vector<int> cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (haveMask ? CPU_ISSET(cpu, &allowed) : cpu < (int)std::thread::hardware_concurrency())
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		nodes.push_back(cpus);
+	}
+	return nodes;
+}
+
+class WorkStealingScheduler
+{
+public:
+	// A task is called with the index of the worker running it
+	typedef std::function<void(int)> Task;
+
+	// threads <= 0 uses one per CPU, and only then pins the workers
+	explicit WorkStealingScheduler(int threads = 0)
+	{
+		bool pin = threads <= 0;
+		std::vector<std::vector<int>> nodes = DetectNumaNodes();
+		int cpuCount = 0;
+		for (size_t node = 0; node < nodes.size(); node++)
+		{
+			cpuCount += (int)nodes[node].size();
+		}
+		if (threads <= 0)
+		{
+			threads = std::max(cpuCount, 1);
+		}
+
+		// worker i goes to node i % nodes, on the next CPU of that node
+		for (int worker = 0; worker < threads; worker++)
+		{
+			queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue));
+		}
+		nodeOfWorker.resize(threads);
+		cpuOfWorker.resize(threads);
+		for (int worker = 0; worker < threads; worker++)
+		{
+			int node = worker % (int)nodes.size();
+			const std::vector<int> &cpus = nodes[node];
+			nodeOfWorker[worker] = node;
+			cpuOfWorker[worker] = (pin && !cpus.empty()) ? cpus[(worker / nodes.size()) % cpus.size()] : -1;
+		}
+
+		// steal order: the other workers of the same node, then the rest, each
+		// list starting after the worker itself so thieves spread out
+		victims.resize(threads);
+		for (int worker = 0; worker < threads; worker++)
+		{
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (int i = 1; i < threads; i++)
+				{
+					int victim = (worker + i) % threads;
+					if ((nodeOfWorker[victim] == nodeOfWorker[worker]) == (pass == 0))
+					{
+						victims[worker].push_back(victim);
+					}
+				}
+			}
+		}
+
+		// if a thread cannot be started, the ones already running are stopped
+		// before the exception (std::system_error) leaves the constructor
+		try
+		{
+			for (int worker = 0; worker < threads; worker++)
+			{
+				workers.push_back(std::thread([this, worker] { work(worker); }));
+			}
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+	}
+
+	// Finishes every queued task first
+	~WorkStealingScheduler()
+	{
+		waitIdle();
+		stop();
+	}
+
+	int size() const
+	{
+		return (int)workers.size();
+	}
+
+	int nodeOf(int worker) const
+	{
+		return nodeOfWorker[worker];
+	}
+
+	// CPU the worker is pinned to, -1 if none
+	int cpuOf(int worker) const
+	{
+		return cpuOfWorker[worker];
+	}
+
+	// Tasks taken from another worker's deque so far
+	long steals() const
+	{
+		return stolen.load(std::memory_order_relaxed);
+	}
+
+	// Queue a task from outside the scheduler; the deques are filled in turn
+	void submit(Task task)
+	{
+		push((int)(nextQueue++ % queues.size()), std::move(task));
+	}
+
+	// Queue a task from inside a task running on worker: it goes on that
+	// worker's deque, where other workers can steal it
+	void spawn(int worker, Task task)
+	{
+		push(worker, std::move(task));
+	}
+
+	// Block until every submitted and spawned task has finished. If a task
+	// threw, the tasks still queued after it were dropped unrun and the first
+	// exception is rethrown here (once).
+	void wait()
+	{
+		waitIdle();
+		std::exception_ptr error;
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			std::swap(error, firstError);
+			failed = false;
+		}
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	// Drop the tasks not started yet and wait for the running ones, discarding
+	// any exception; for a caller unwinding while its tasks still use its
+	// locals
+	void cancel()
+	{
+		failed = true;
+		waitIdle();
+		std::lock_guard<std::mutex> lock(errorMutex);
+		firstError = std::exception_ptr();
+		failed = false;
+	}
+
+private:
+	void waitIdle()
+	{
+		std::unique_lock<std::mutex> lock(doneMutex);
+		done.wait(lock, [this] { return pending.load() == 0; });
+	}
+
+	// Let the idle workers return and join them
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+			stopping = true;
+		}
+		idle.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	struct alignas(64) WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void push(int worker, Task task)
+	{
+		// counted before it is queued, so pending cannot reach 0 while the task
+		// is waiting; taken back if queueing it fails
+		pending++;
+		try
+		{
+			std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+			queues[worker]->tasks.push_back(std::move(task));
+		}
+		catch (...)
+		{
+			finish();
+			throw;
+		}
+		queued++;
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+		}
+		idle.notify_one();
+	}
+
+	bool popOwn(int worker, Task &task)
+	{
+		WorkerQueue &queue = *queues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+		{
+			return false;
+		}
+		task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+		return true;
+	}
+
+	bool steal(int worker, Task &task)
+	{
+		for (size_t i = 0; i < victims[worker].size(); i++)
+		{
+			WorkerQueue &queue = *queues[victims[worker][i]];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty())
+			{
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+				stolen.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// One task less pending
+	void finish()
+	{
+		if (--pending == 0)
+		{
+			std::lock_guard<std::mutex> lock(doneMutex);
+			done.notify_all();
+		}
+	}
+
+	void work(int worker)
+	{
+		if (cpuOfWorker[worker] >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpuOfWorker[worker], &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+		while (true)
+		{
+			Task task;
+			if (popOwn(worker, task) || steal(worker, task))
+			{
+				queued--;
+				// an exception must not leave the thread (std::terminate); the
+				// first one is kept for wait() and later tasks are skipped
+				if (!failed.load(std::memory_order_relaxed))
+				{
+					try
+					{
+						task(worker);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(errorMutex);
+						if (!firstError)
+						{
+							firstError = std::current_exception();
+						}
+						failed = true;
+					}
+				}
+				task = Task();
+				finish();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(idleMutex);
+			idle.wait(lock, [this] { return stopping || queued.load() > 0; });
+			if (stopping && queued.load() == 0)
+			{
+				return;
+			}
+		}
+	}
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::vector<int> nodeOfWorker;
+	std::vector<int> cpuOfWorker;
+	std::vector<std::vector<int>> victims;
+	std::vector<std::thread> workers;
+
+	// tasks waiting in some deque, and tasks not finished yet
+	std::atomic<long> queued{0};
+	std::atomic<long> pending{0};
+	std::atomic<long> stolen{0};
+	std::atomic<unsigned long> nextQueue{0};
+
+	std::mutex idleMutex;
+	std::condition_variable idle;
+	bool stopping = false;
+	std::mutex doneMutex;
+	std::condition_variable done;
+
+	// first exception thrown by a task since the last wait()
+	std::atomic<bool> failed{false};
+	std::mutex errorMutex;
+	std::exception_ptr firstError;
+};
+
+#endif
@@ -0,0 +1,723 @@
+#ifndef SYMMAT_SERVER_H
+#define SYMMAT_SERVER_H
+
+// Server mode: one table loaded and preprocessed once, queried over a Unix
+// domain socket so each query costs milliseconds instead of a process start
+// and a reload.
+//
+// The protocol is JSON lines: every request is one flat JSON object on a line
+// of its own, every response one object on a line. Rows are given by name or
+// by index. Requests:
+//
+//   {"op": "info"}
+//       rows, cols, metric, precision and the row names
+//   {"op": "row", "row": "Chitin1", "permutations": 1000, "seed": 7}
+//       the row against every row: "values" (and with permutations,
+//       "pValues") in row order, null for the row itself and untestable pairs.
+//       Each p-value is the one a "pair" request with the same seed gets.
+//   {"op": "pair", "a": "Chitin1", "b": 3, "permutations": 1000000}
+//       "r" and "p" of one pair
+//
+// permutations defaults to 0 for "row" and to the server's permutation count
+// for "pair", and a request may ask for at most the server's maximum (per
+// pair); seed defaults to the server's seed. A request's "id", if any, is
+// copied into its response. Failed requests get {"ok": false, "error": ...}.
+//
+// Every connection may pipeline requests; they are run concurrently on the
+// shared thread pool and each response is written as soon as it is ready, so
+// responses can come back out of order (match them by id). The p-values of a
+// "row" request are split into slices that run as tasks of their own, so one
+// row query uses the whole pool. When the server stops, permutation tests
+// still running give up after their current chunk and answer with an error.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "symmat.h"
+#include "table.h"
+#include "threadpool.h"
+
+// Set by SIGINT/SIGTERM; the server stops accepting and exits
+inline volatile std::sig_atomic_t gServerStop = 0;
+
+// Default for the most permutations per pair a request may ask for
+const long kServerMaxPermutations = 100000000;
+
+// A value of a flat JSON object: the raw token (to echo ids back exactly) and,
+// for strings, the decoded text
+struct JsonValue
+{
+	std::string raw;
+	std::string text;
+	bool isString = false;
+};
+
+// Whether text is a JSON number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+inline bool isJsonNumber(const std::string &text)
+{
+	size_t i = 0, n = text.size();
+	auto digits = [&] {
+		size_t start = i;
+		while (i < n && isdigit((unsigned char)text[i]))
+		{
+			i++;
+		}
+		return i > start;
+	};
+	if (i < n && text[i] == '-')
+	{
+		i++;
+	}
+	if (i < n && text[i] == '0')
+	{
+		i++;
+	}
+	else if (!digits())
+	{
+		return false;
+	}
+	if (i < n && text[i] == '.')
+	{
+		i++;
+		if (!digits())
+		{
+			return false;
+		}
+	}
+	if (i < n && (text[i] == 'e' || text[i] == 'E'))
+	{
+		i++;
+		if (i < n && (text[i] == '+' || text[i] == '-'))
+		{
+			i++;
+		}
+		if (!digits())
+		{
+			return false;
+		}
+	}
+	return i == n;
+}
+
+// Parse one flat JSON object (string, number, true/false/null values only);
+// false if line is not one
+inline bool parseJsonObject(const std::string &line, std::map<std::string, JsonValue> &fields)
+{
+	fields.clear();
+	size_t i = 0, n = line.size();
+	auto skipSpace = [&] {
+		while (i < n && isspace((unsigned char)line[i]))
+		{
+			i++;
+		}
+	};
+	auto parseString = [&](std::string &text) {
+		if (i >= n || line[i] != '"')
+		{
+			return false;
+		}
+		for (i++; i < n && line[i] != '"'; i++)
+		{
+			if (line[i] == '\\' && i + 1 < n)
+			{
+				char c = line[++i];
+				text += c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+			}
+			else
+			{
+				text += line[i];
+			}
+		}
+		if (i >= n)
+		{
+			return false;
+		}
+		i++;
+		return true;
+	};
+	skipSpace();
+	if (i >= n || line[i++] != '{')
+	{
+		return false;
+	}
+	skipSpace();
+	if (i < n && line[i] == '}')
+	{
+		i++;
+	}
+	else
+	{
+		while (true)
+		{
+			std::string key;
+			skipSpace();
+			if (!parseString(key))
+			{
+				return false;
+			}
+			skipSpace();
+			if (i >= n || line[i++] != ':')
+			{
+				return false;
+			}
+			skipSpace();
+			JsonValue value;
+			size_t start = i;
+			if (i < n && line[i] == '"')
+			{
+				value.isString = true;
+				if (!parseString(value.text))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				while (i < n && line[i] != ',' && line[i] != '}' && !isspace((unsigned char)line[i]))
+				{
+					i++;
+				}
+				value.text = line.substr(start, i - start);
+				// raw values are echoed back (ids), so only JSON literals pass
+				if (value.text != "true" && value.text != "false" && value.text != "null" && !isJsonNumber(value.text))
+				{
+					return false;
+				}
+			}
+			value.raw = line.substr(start, i - start);
+			fields[key] = value;
+			skipSpace();
+			if (i < n && line[i] == ',')
+			{
+				i++;
+				continue;
+			}
+			if (i < n && line[i] == '}')
+			{
+				i++;
+				break;
+			}
+			return false;
+		}
+	}
+	skipSpace();
+	return i == n;
+}
+
+inline std::string jsonString(const std::string &text)
+{
+	std::string quoted = "\"";
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			quoted += '\\';
+			quoted += c;
+		}
+		else if (c == '\n')
+		{
+			quoted += "\\n";
+		}
+		else if (c == '\t')
+		{
+			quoted += "\\t";
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			quoted += ' ';
+		}
+		else
+		{
+			quoted += c;
+		}
+	}
+	return quoted + "\"";
+}
+
+// A number, or null for NaN
+inline void writeJsonNumber(std::ostream &out, double value)
+{
+	if (value != value || std::isinf(value))
+	{
+		out << "null";
+	}
+	else
+	{
+		out << value;
+	}
+}
+
+class Server
+{
+public:
+	// Called once with the response line (without the newline)
+	typedef std::function<void(const std::string &)> Reply;
+
+	// engine must have been loaded from table; defaults give the permutation
+	// count and seed of requests that do not name their own
+	Server(const symmat::Engine &engine, const Table &table, const symmat::Options &defaults, ThreadPool &pool,
+		   long maxPermutations = kServerMaxPermutations)
+		: engine(engine), table(table), defaults(defaults), pool(pool), maxPermutations(maxPermutations)
+	{
+		for (int r = table.rows - 1; r >= 0; r--)
+		{
+			rowIndex[table.rowNames[r]] = r;
+		}
+	}
+
+	// Answer one request line (without the newline). Runs on the pool; a
+	// "row" request with permutations queues its slices there and the last
+	// slice to finish sends the reply, so no worker waits for another.
+	void handle(const std::string &line, Reply reply) const
+	{
+		std::map<std::string, JsonValue> request;
+		std::ostringstream out;
+		out << std::setprecision(10);
+		if (!parseJsonObject(line, request))
+		{
+			reply("{\"ok\": false, \"error\": \"not a flat JSON object\"}");
+			return;
+		}
+		out << "{";
+		if (request.count("id"))
+		{
+			out << "\"id\": " << request["id"].raw << ", ";
+		}
+		std::string error;
+		std::string op = request["op"].text;
+		if (op == "info")
+		{
+			out << "\"ok\": true, \"rows\": " << table.rows << ", \"cols\": " << table.cols << ", \"metric\": " << jsonString(defaults.metric)
+				<< ", \"precision\": " << jsonString(defaults.precision) << ", \"names\": [";
+			for (int r = 0; r < table.rows; r++)
+			{
+				out << (r ? ", " : "") << jsonString(table.rowNames[r]);
+			}
+			out << "]}";
+			reply(out.str());
+			return;
+		}
+		long permutations = 0;
+		unsigned seed = defaults.seed;
+		if (!number(request, "seed", seed, error))
+		{
+			reply(failure(out, error));
+			return;
+		}
+		if (op == "row")
+		{
+			std::shared_ptr<RowQuery> query(new RowQuery);
+			if (!rowOf(request, "row", query->a, error) || !permutationsOf(request, permutations, error))
+			{
+				reply(failure(out, error));
+				return;
+			}
+			query->permutations = permutations;
+			query->seed = seed;
+			query->head = out.str();
+			query->reply = reply;
+			engine.row(query->a, query->values);
+			if (permutations <= 0)
+			{
+				finishRow(*query);
+				return;
+			}
+			// a few slices per worker, so slices of other requests interleave
+			query->pValues.assign(table.rows, NAN);
+			int slices = std::max(1, std::min(table.rows, pool.size() * 4));
+			query->remaining = slices;
+			for (int slice = 0; slice < slices; slice++)
+			{
+				int first = (int)((long)table.rows * slice / slices);
+				int last = (int)((long)table.rows * (slice + 1) / slices);
+				pool.submit([this, query, first, last](int) {
+					for (int b = first; b < last; b++)
+					{
+						if (b != query->a)
+						{
+							query->pValues[b] = engine.pValue(query->a, b, query->permutations, query->seed, &stopping);
+						}
+					}
+					if (--query->remaining == 0)
+					{
+						finishRow(*query);
+					}
+				});
+			}
+			return;
+		}
+		if (op == "pair")
+		{
+			int a, b;
+			permutations = defaults.permutations;
+			if (!rowOf(request, "a", a, error) || !rowOf(request, "b", b, error) || !permutationsOf(request, permutations, error))
+			{
+				reply(failure(out, error));
+				return;
+			}
+			if (a == b)
+			{
+				reply(failure(out, "a and b are the same row"));
+				return;
+			}
+			double r = engine.value(a, b);
+			double p = engine.pValue(a, b, permutations, seed, &stopping);
+			if (stopping)
+			{
+				reply(failure(out, "the server is stopping"));
+				return;
+			}
+			out << "\"ok\": true, \"a\": " << jsonString(table.rowNames[a]) << ", \"b\": " << jsonString(table.rowNames[b]) << ", \"r\": ";
+			writeJsonNumber(out, r);
+			out << ", \"permutations\": " << permutations << ", \"p\": ";
+			writeJsonNumber(out, p);
+			out << "}";
+			reply(out.str());
+			return;
+		}
+		reply(failure(out, op.empty() ? "missing \"op\"" : "unknown op \"" + op + "\""));
+	}
+
+	// Serve on socketPath until SIGINT/SIGTERM; false if the socket cannot be
+	// opened. One line per connection goes to log, if given.
+	bool serve(const std::string &socketPath, std::string &error, std::ostream *log = NULL)
+	{
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketPath.size() >= sizeof(address.sun_path))
+		{
+			error = "socket path too long";
+			return false;
+		}
+		strcpy(address.sun_path, socketPath.c_str());
+		// a socket left behind by an earlier server is replaced, anything
+		// else at the path is left alone
+		struct stat existing;
+		if (lstat(socketPath.c_str(), &existing) == 0)
+		{
+			if (!S_ISSOCK(existing.st_mode))
+			{
+				error = "\"" + socketPath + "\" exists and is not a socket";
+				return false;
+			}
+			unlink(socketPath.c_str());
+		}
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool bound = listener >= 0 && bind(listener, (sockaddr *)&address, sizeof(address)) == 0;
+		struct stat created;
+		if (!bound || lstat(socketPath.c_str(), &created) != 0 || listen(listener, 64) != 0)
+		{
+			error = strerror(errno);
+			if (bound)
+			{
+				unlink(socketPath.c_str());
+			}
+			if (listener >= 0)
+			{
+				close(listener);
+			}
+			return false;
+		}
+		gServerStop = 0;
+		stopping = false;
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGINT, stopServer);
+		signal(SIGTERM, stopServer);
+
+		std::vector<Reader> readers;
+		long connections = 0;
+		while (!gServerStop)
+		{
+			reap(readers, false);
+			pollfd ready = {listener, POLLIN, 0};
+			if (poll(&ready, 1, 200) <= 0)
+			{
+				continue;
+			}
+			int fd = accept(listener, NULL, NULL);
+			if (fd < 0)
+			{
+				continue;
+			}
+			std::shared_ptr<Connection> connection(new Connection(fd));
+			if (log)
+			{
+				*log << "serve: connection " << ++connections << std::endl;
+			}
+			readers.push_back(Reader());
+			readers.back().connection = connection;
+			readers.back().thread = std::thread([this, connection] {
+				read(connection);
+				connection->finished = true;
+			});
+		}
+
+		// stop reading new requests, cut the running permutation tests short
+		// and let every request answer
+		stopping = true;
+		close(listener);
+		// only if the path still is the socket this server created
+		struct stat current;
+		if (lstat(socketPath.c_str(), &current) == 0 && S_ISSOCK(current.st_mode) && current.st_dev == created.st_dev &&
+			current.st_ino == created.st_ino)
+		{
+			unlink(socketPath.c_str());
+		}
+		for (size_t i = 0; i < readers.size(); i++)
+		{
+			shutdown(readers[i].connection->fd, SHUT_RD);
+		}
+		reap(readers, true);
+		pool.wait();
+		return true;
+	}
+
+private:
+	// A "row" request whose p-values are computed in slices
+	struct RowQuery
+	{
+		int a = 0;
+		long permutations = 0;
+		unsigned seed = 0;
+		// the response up to and including the id
+		std::string head;
+		Reply reply;
+		std::vector<double> values;
+		std::vector<double> pValues;
+		// slices not finished yet
+		std::atomic<int> remaining{0};
+	};
+
+	struct Connection
+	{
+		explicit Connection(int fd) : fd(fd)
+		{
+		}
+		~Connection()
+		{
+			close(fd);
+		}
+		// Write a whole response line; responses of concurrent requests do not
+		// interleave
+		void send(const std::string &line)
+		{
+			std::lock_guard<std::mutex> lock(writing);
+			size_t sent = 0;
+			while (sent < line.size())
+			{
+				ssize_t n = ::send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+				if (n <= 0)
+				{
+					return;
+				}
+				sent += n;
+			}
+		}
+
+		int fd;
+		std::atomic<bool> finished{false};
+		std::mutex writing;
+	};
+
+	struct Reader
+	{
+		std::thread thread;
+		std::shared_ptr<Connection> connection;
+	};
+
+	// Join the reader threads whose connection was closed (all of them if all)
+	static void reap(std::vector<Reader> &readers, bool all)
+	{
+		for (size_t i = 0; i < readers.size();)
+		{
+			if (all || readers[i].connection->finished)
+			{
+				readers[i].thread.join();
+				readers.erase(readers.begin() + i);
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	static void stopServer(int)
+	{
+		gServerStop = 1;
+	}
+
+	// Split the requests of a connection into lines and queue each on the pool
+	void read(std::shared_ptr<Connection> connection)
+	{
+		std::string buffer;
+		char chunk[4096];
+		ssize_t n;
+		while ((n = ::read(connection->fd, chunk, sizeof(chunk))) > 0)
+		{
+			buffer.append(chunk, n);
+			size_t newline;
+			while ((newline = buffer.find('\n')) != std::string::npos)
+			{
+				std::string line = buffer.substr(0, newline);
+				buffer.erase(0, newline + 1);
+				if (!line.empty() && line[line.size() - 1] == '\r')
+				{
+					line.erase(line.size() - 1);
+				}
+				if (line.find_first_not_of(" \t") == std::string::npos)
+				{
+					continue;
+				}
+				pool.submit([this, connection, line](int) {
+					handle(line, [connection](const std::string &response) { connection->send(response + "\n"); });
+				});
+			}
+		}
+	}
+
+	// Row named (or numbered) by field
+	bool rowOf(std::map<std::string, JsonValue> &request, const char *field, int &row, std::string &error) const
+	{
+		if (!request.count(field))
+		{
+			error = std::string("missing \"") + field + "\"";
+			return false;
+		}
+		const JsonValue &value = request[field];
+		if (value.isString)
+		{
+			auto found = rowIndex.find(value.text);
+			if (found == rowIndex.end())
+			{
+				error = "no row named " + jsonString(value.text);
+				return false;
+			}
+			row = found->second;
+			return true;
+		}
+		char *end;
+		long index = strtol(value.text.c_str(), &end, 10);
+		if (*end || index < 0 || index >= table.rows)
+		{
+			error = std::string("\"") + field + "\" is not a row name or index";
+			return false;
+		}
+		row = (int)index;
+		return true;
+	}
+
+	// Optional non-negative integer field; left alone if absent
+	template <class N>
+	bool number(std::map<std::string, JsonValue> &request, const char *field, N &result, std::string &error) const
+	{
+		if (!request.count(field))
+		{
+			return true;
+		}
+		const JsonValue &value = request[field];
+		char *end;
+		double number = strtod(value.text.c_str(), &end);
+		if (value.isString || *end || !(number >= 0) || number != std::floor(number))
+		{
+			error = std::string("\"") + field + "\" is not a non-negative integer";
+			return false;
+		}
+		// checked before the cast, which is undefined for values N cannot hold
+		if (number >= std::ldexp(1.0, std::numeric_limits<N>::digits))
+		{
+			error = std::string("\"") + field + "\" is too large";
+			return false;
+		}
+		result = (N)number;
+		return true;
+	}
+
+	// The "permutations" field, left alone if absent; at most maxPermutations
+	bool permutationsOf(std::map<std::string, JsonValue> &request, long &permutations, std::string &error) const
+	{
+		if (!number(request, "permutations", permutations, error))
+		{
+			return false;
+		}
+		if (request.count("permutations") && permutations > maxPermutations)
+		{
+			error = "\"permutations\" is above the server's maximum of " + std::to_string(maxPermutations);
+			return false;
+		}
+		return true;
+	}
+
+	// Send the response of a row request once all its p-values are in
+	void finishRow(const RowQuery &query) const
+	{
+		std::ostringstream out;
+		out << std::setprecision(10) << query.head;
+		if (stopping && query.permutations > 0)
+		{
+			query.reply(failure(out, "the server is stopping"));
+			return;
+		}
+		out << "\"ok\": true, \"row\": " << jsonString(table.rowNames[query.a]) << ", \"values\": [";
+		for (size_t b = 0; b < query.values.size(); b++)
+		{
+			out << (b ? ", " : "");
+			writeJsonNumber(out, query.values[b]);
+		}
+		out << "]";
+		if (query.permutations > 0)
+		{
+			out << ", \"permutations\": " << query.permutations << ", \"pValues\": [";
+			for (size_t b = 0; b < query.pValues.size(); b++)
+			{
+				out << (b ? ", " : "");
+				writeJsonNumber(out, query.pValues[b]);
+			}
+			out << "]";
+		}
+		out << "}";
+		query.reply(out.str());
+	}
+
+	static std::string failure(std::ostringstream &out, const std::string &error)
+	{
+		out << "\"ok\": false, \"error\": " << jsonString(error) << "}";
+		return out.str();
+	}
+
+	const symmat::Engine &engine;
+	const Table &table;
+	symmat::Options defaults;
+	ThreadPool &pool;
+	long maxPermutations;
+	std::map<std::string, int> rowIndex;
+	// set when serve() stops; running permutation tests check it between
+	// chunks
+	std::atomic<bool> stopping{false};
+};
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef SYMMAT_STATS_H
+#define SYMMAT_STATS_H
+
+// Run instrumentation: wall and CPU time per phase, per-thread work counters,
+// a periodic progress line and a JSON dump.
+//
+// Each worker thread only ever writes its own ThreadCounters slot (one cache
+// line each), with relaxed stores and no read-modify-write, so counting costs
+// the hot loop next to nothing. The slots are only summed when a progress line
+// or the final report is produced.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum Phase
+{
+	kPhaseLoad,
+	kPhaseStandardize,
+	kPhaseCorrelate,
+	kPhasePermute,
+	kPhaseWrite,
+	kPhaseCount
+};
+
+const char *const kPhaseNames[kPhaseCount] = {"load", "standardize", "correlate", "permute", "write"};
+
+struct alignas(64) ThreadCounters
+{
+	std::atomic<long> pairs{0};
+	std::atomic<long> permutations{0};
+
+	// Only the owning thread calls these
+	void addPairs(long n)
+	{
+		pairs.store(pairs.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	void addPermutations(long n)
+	{
+		permutations.store(permutations.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+};
+
+class Stats
+{
+public:
+	explicit Stats(int threads = 1)
+	{
+		for (int i = 0; i < threads; i++)
+		{
+			slots.push_back(std::unique_ptr<ThreadCounters>(new ThreadCounters));
+		}
+		for (int phase = 0; phase < kPhaseCount; phase++)
+		{
+			wall[phase] = cpu[phase] = 0.0;
+			expected[phase] = 0;
+		}
+		currentPhase = -1;
+	}
+
+	~Stats()
+	{
+		stopProgress();
+	}
+
+	ThreadCounters &counters(int thread)
+	{
+		return *slots[thread];
+	}
+
+	int threads() const
+	{
+		return (int)slots.size();
+	}
+
+	// Work a phase is expected to do, for the progress percentage and ETA
+	// (pairs for correlate, permutations for permute)
+	void expect(Phase phase, long total)
+	{
+		expected[phase] = total;
+	}
+
+	// Extra key/value pairs for the JSON dump (table size, options, ...)
+	void set(const std::string &key, double value)
+	{
+		info.push_back(std::make_pair(key, value));
+	}
+
+	void startPhase(Phase phase)
+	{
+		phaseStart[phase] = Clock::now();
+		phaseCpuStart[phase] = std::clock();
+		phaseStartCount[phase] = done(phase);
+		currentPhase.store(phase);
+	}
+
+	void stopPhase(Phase phase)
+	{
+		wall[phase] += std::chrono::duration<double>(Clock::now() - phaseStart[phase]).count();
+		cpu[phase] += (double)(std::clock() - phaseCpuStart[phase]) / CLOCKS_PER_SEC;
+		timed = true;
+		currentPhase.store(-1);
+	}
+
+	long totalPairs() const
+	{
+		long sum = 0;
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			sum += slots[i]->pairs.load(std::memory_order_relaxed);
+		}
+		return sum;
+	}
+
+	long totalPermutations() const
+	{
+		long sum = 0;
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			sum += slots[i]->permutations.load(std::memory_order_relaxed);
+		}
+		return sum;
+	}
+
+	// Print a progress line to out every interval seconds until stopProgress()
+	void startProgress(double interval, std::ostream &out)
+	{
+		if (interval <= 0 || reporter.joinable())
+		{
+			return;
+		}
+		stopping = false;
+		reporter = std::thread([this, interval, &out] {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!wakeup.wait_for(lock, std::chrono::duration<double>(interval), [this] { return stopping; }))
+			{
+				out << progressLine() << std::endl;
+			}
+		});
+	}
+
+	void stopProgress()
+	{
+		if (!reporter.joinable())
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		reporter.join();
+	}
+
+	std::string progressLine() const
+	{
+		int phase = currentPhase.load();
+		if (phase < 0)
+		{
+			return "progress: idle";
+		}
+		double elapsed = std::chrono::duration<double>(Clock::now() - phaseStart[phase]).count();
+		long count = done((Phase)phase) - phaseStartCount[phase];
+		const char *unit = phase == kPhasePermute ? "perms" : "pairs";
+		double rate = elapsed > 0 ? count / elapsed : 0.0;
+		std::ostringstream line;
+		line << std::setprecision(3) << "progress: " << kPhaseNames[phase];
+		if (expected[phase] > 0)
+		{
+			line << " " << std::fixed << std::setprecision(1) << 100.0 * count / expected[phase] << "%"
+				 << std::defaultfloat << std::setprecision(3) << " (" << count << "/" << expected[phase] << " " << unit
+				 << ", " << rate << " " << unit << "/s";
+			if (rate > 0)
+			{
+				line << ", ETA " << formatSeconds((expected[phase] - count) / rate);
+			}
+			line << ")";
+		}
+		else
+		{
+			line << " (" << count << " " << unit << ", " << rate << " " << unit << "/s)";
+		}
+		return line.str();
+	}
+
+	bool writeJson(const std::string &filename) const
+	{
+		std::ofstream out(filename);
+		if (!out)
+		{
+			return false;
+		}
+		out << std::setprecision(9) << "{\n";
+		for (size_t i = 0; i < info.size(); i++)
+		{
+			out << "  \"" << info[i].first << "\": " << info[i].second << ",\n";
+		}
+		// phase times and the rates derived from them only if some phase was
+		// timed (batch runs count work but time whole tables, not phases)
+		if (timed)
+		{
+			out << "  \"phases\": {\n";
+			for (int phase = 0; phase < kPhaseCount; phase++)
+			{
+				out << "    \"" << kPhaseNames[phase] << "\": {\"wallSeconds\": " << wall[phase] << ", \"cpuSeconds\": " << cpu[phase] << "}"
+					<< (phase + 1 < kPhaseCount ? "," : "") << "\n";
+			}
+			out << "  },\n";
+		}
+		long pairs = totalPairs(), permutations = totalPermutations();
+		out << "  \"pairs\": " << pairs << ",\n";
+		out << "  \"permutations\": " << permutations << ",\n";
+		if (timed)
+		{
+			out << "  \"pairsPerSecond\": " << (wall[kPhaseCorrelate] > 0 ? pairs / wall[kPhaseCorrelate] : 0.0) << ",\n";
+			out << "  \"permutationsPerSecond\": " << (wall[kPhasePermute] > 0 ? permutations / wall[kPhasePermute] : 0.0) << ",\n";
+		}
+		out << "  \"threads\": [";
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			out << (i ? ", " : "") << "{\"pairs\": " << slots[i]->pairs.load() << ", \"permutations\": " << slots[i]->permutations.load() << "}";
+		}
+		out << "]\n}\n";
+		return true;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	long done(Phase phase) const
+	{
+		return phase == kPhasePermute ? totalPermutations() : totalPairs();
+	}
+
+	static std::string formatSeconds(double seconds)
+	{
+		long s = (long)(seconds + 0.5);
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+		return buffer;
+	}
+
+	std::vector<std::unique_ptr<ThreadCounters>> slots;
+	std::vector<std::pair<std::string, double>> info;
+	double wall[kPhaseCount];
+	double cpu[kPhaseCount];
+	long expected[kPhaseCount];
+	long phaseStartCount[kPhaseCount];
+	Clock::time_point phaseStart[kPhaseCount];
+	std::clock_t phaseCpuStart[kPhaseCount];
+	std::atomic<int> currentPhase;
+	// whether any phase has been timed
+	bool timed = false;
+
+	std::thread reporter;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+};
+
+// Times one phase for as long as it is in scope; a null Stats is ignored
+class PhaseTimer
+{
+public:
+	PhaseTimer(Stats *stats, Phase phase) : stats(stats), phase(phase)
+	{
+		if (stats)
+		{
+			stats->startPhase(phase);
+		}
+	}
+	~PhaseTimer()
+	{
+		if (stats)
+		{
+			stats->stopPhase(phase);
+		}
+	}
+
+private:
+	Stats *stats;
+	Phase phase;
+};
+
+#endif
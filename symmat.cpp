@@ -0,0 +1,332 @@
+// symmat library: the C++ (symmat.h) and C (symmat_c.h) interfaces over the
+// correlation engine. Every metric/precision combination of the templated
+// engine is instantiated here, once, and picked at run time from the options.
+
+#include <atomic>
+#include <cmath>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "approx.h"
+#include "correlation.h"
+#include "symmat.h"
+#include "symmat_c.h"
+
+using namespace std;
+
+// Check the matrix and options, then run f(Metric(), T(), Acc()); a symmat_c.h
+// error code. No exception gets out, since the C interface calls this too: an
+// unexpected one (the scheduler failing to start a thread, say) is
+// SYMMAT_INTERNAL_ERROR, with its message in *detail if detail is given.
+template <class F>
+static int Run(const symmat::Matrix &matrix, const string &metric, const string &precision, F f, string *detail = NULL)
+{
+	if (matrix.rows < 0 || matrix.cols < 1 || (matrix.rows > 0 && !matrix.data) || (matrix.stride != 0 && matrix.stride < matrix.cols))
+	{
+		return SYMMAT_INVALID_MATRIX;
+	}
+	if (!WithMetric(metric, [](auto) {}))
+	{
+		return SYMMAT_UNKNOWN_METRIC;
+	}
+	try
+	{
+		if (!WithConfiguration(metric, precision, f))
+		{
+			return SYMMAT_UNKNOWN_PRECISION;
+		}
+	}
+	catch (const bad_alloc &)
+	{
+		return SYMMAT_OUT_OF_MEMORY;
+	}
+	catch (const exception &e)
+	{
+		if (detail)
+		{
+			*detail = e.what();
+		}
+		return SYMMAT_INTERNAL_ERROR;
+	}
+	catch (...)
+	{
+		return SYMMAT_INTERNAL_ERROR;
+	}
+	return SYMMAT_OK;
+}
+
+static long Stride(const symmat::Matrix &matrix)
+{
+	return matrix.stride ? matrix.stride : matrix.cols;
+}
+
+static bool Fail(int code, string *error, const string &detail = "")
+{
+	if (code != SYMMAT_OK && error)
+	{
+		*error = symmat_error_string(code);
+		if (!detail.empty())
+		{
+			*error += ": " + detail;
+		}
+	}
+	return code == SYMMAT_OK;
+}
+
+namespace symmat
+{
+
+bool correlate(const Matrix &matrix, const Options &options, Result &result, string *error)
+{
+	result = Result();
+	string detail;
+	int code = Run(
+		matrix, options.metric, options.precision,
+		[&](auto metric, auto t, auto acc) {
+			result.rows = matrix.rows;
+			result.values.resize(Result::pairs(matrix.rows));
+			result.pValues.resize(options.permutations > 0 ? result.values.size() : 0);
+			CorrelationPairs<decltype(metric), decltype(t), decltype(acc)>(matrix.data, matrix.rows, matrix.cols, Stride(matrix), options.permutations,
+																		   options.seed, result.values.data(), result.pValues.data(), options.stats,
+																		   options.threads);
+		},
+		&detail);
+	return Fail(code, error, detail);
+}
+
+bool findStrongPairs(const Matrix &matrix, const Options &options, const StrongPairOptions &approx, StrongPairs &result, string *error)
+{
+	result = StrongPairs();
+	if (options.metric != PearsonMetric::name() && options.metric != CosineMetric::name())
+	{
+		if (error)
+		{
+			*error = "the approximate search needs the pearson or cosine metric";
+		}
+		return false;
+	}
+	string detail;
+	int code = Run(
+		matrix, options.metric, options.precision,
+		[&](auto metric, auto t, auto acc) {
+			typedef decltype(metric) Metric;
+			if constexpr (is_same<Metric, PearsonMetric>::value || is_same<Metric, CosineMetric>::value)
+			{
+				ApproxSearch<Metric, decltype(t), decltype(acc)>(matrix.data, matrix.rows, matrix.cols, Stride(matrix), approx, options.permutations,
+																 options.seed, result, options.stats);
+			}
+		},
+		&detail);
+	if (!Fail(code, error, detail))
+	{
+		result = StrongPairs();
+		return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+// Resident engine: the PairEngine of the configured metric and precision
+// behind a virtual interface
+
+class EngineCore
+{
+public:
+	virtual ~EngineCore()
+	{
+	}
+	virtual int rows() const = 0;
+	virtual int cols() const = 0;
+	virtual double value(int a, int b) const = 0;
+	virtual double pValue(int a, int b, long permutations, mt19937 &RNG, const atomic<bool> *cancel) const = 0;
+};
+
+template <class Metric, class T, class Acc>
+class TypedEngineCore : public EngineCore
+{
+public:
+	TypedEngineCore(const Matrix &matrix, Stats *stats) : engine(matrix.data, matrix.rows, matrix.cols, Stride(matrix), stats)
+	{
+	}
+	int rows() const
+	{
+		return engine.rows();
+	}
+	int cols() const
+	{
+		return engine.cols();
+	}
+	double value(int a, int b) const
+	{
+		typename PairEngine<Metric, T, Acc>::Scratch scratch;
+		return engine.statistic(a, b, scratch);
+	}
+	double pValue(int a, int b, long permutations, mt19937 &RNG, const atomic<bool> *cancel) const
+	{
+		typename PairEngine<Metric, T, Acc>::Scratch scratch;
+		return engine.pValue(a, b, permutations, RNG, scratch, NULL, cancel);
+	}
+
+private:
+	PairEngine<Metric, T, Acc> engine;
+};
+
+Engine::Engine()
+{
+}
+
+Engine::~Engine()
+{
+}
+
+bool Engine::load(const Matrix &matrix, const Options &options, string *error)
+{
+	core.reset();
+	string detail;
+	int code = Run(
+		matrix, options.metric, options.precision,
+		[&](auto metric, auto t, auto acc) {
+			core.reset(new TypedEngineCore<decltype(metric), decltype(t), decltype(acc)>(matrix, options.stats));
+		},
+		&detail);
+	return Fail(code, error, detail);
+}
+
+bool Engine::loaded() const
+{
+	return core != NULL;
+}
+
+int Engine::rows() const
+{
+	return core ? core->rows() : 0;
+}
+
+int Engine::cols() const
+{
+	return core ? core->cols() : 0;
+}
+
+double Engine::value(int a, int b) const
+{
+	return core->value(a, b);
+}
+
+double Engine::pValue(int a, int b, long permutations, unsigned seed, const atomic<bool> *cancel) const
+{
+	if (permutations <= 0)
+	{
+		return NAN;
+	}
+	mt19937 RNG(seed);
+	return core->pValue(a, b, permutations, RNG, cancel);
+}
+
+void Engine::row(int a, vector<double> &values, vector<double> *pValues, long permutations, unsigned seed) const
+{
+	int n = core->rows();
+	values.assign(n, NAN);
+	for (int b = 0; b < n; b++)
+	{
+		if (b != a)
+		{
+			values[b] = core->value(a, b);
+		}
+	}
+	if (!pValues || permutations <= 0)
+	{
+		return;
+	}
+	pValues->assign(n, NAN);
+	for (int b = 0; b < n; b++)
+	{
+		if (b != a)
+		{
+			(*pValues)[b] = pValue(a, b, permutations, seed);
+		}
+	}
+}
+
+const char *metricDescription(const string &metric)
+{
+	const char *description = NULL;
+	WithMetric(metric, [&](auto m) { description = decltype(m)::description(); });
+	return description;
+}
+
+const char *metricTail(const string &metric)
+{
+	const char *tail = NULL;
+	WithMetric(metric, [&](auto m) { tail = decltype(m)::Term::tail(); });
+	return tail;
+}
+
+} // namespace symmat
+
+//--------------------------------------------------------------------------------
+// C interface
+
+extern "C" void symmat_default_options(symmat_options *options)
+{
+	options->metric = PearsonMetric::name();
+	options->precision = "double";
+	options->permutations = 0;
+	options->seed = 0;
+	options->threads = 1;
+}
+
+extern "C" size_t symmat_pair_count(int rows)
+{
+	return symmat::Result::pairs(rows);
+}
+
+extern "C" size_t symmat_pair_index(int a, int b, int rows)
+{
+	return symmat::Result::index(a, b, rows);
+}
+
+extern "C" int symmat_correlate(const double *data, int rows, int cols, long stride, const symmat_options *options, double *values,
+								double *p_values)
+{
+	symmat_options defaults;
+	symmat_default_options(&defaults);
+	if (!options)
+	{
+		options = &defaults;
+	}
+	symmat::Matrix matrix;
+	matrix.data = data;
+	matrix.rows = rows;
+	matrix.cols = cols;
+	matrix.stride = stride;
+	if (rows > 1 && !values)
+	{
+		return SYMMAT_INVALID_MATRIX;
+	}
+	return Run(matrix, options->metric ? options->metric : defaults.metric, options->precision ? options->precision : defaults.precision,
+			   [&](auto metric, auto t, auto acc) {
+				   CorrelationPairs<decltype(metric), decltype(t), decltype(acc)>(data, rows, cols, Stride(matrix), options->permutations, options->seed,
+																				  values, p_values, NULL, options->threads);
+			   });
+}
+
+extern "C" const char *symmat_error_string(int code)
+{
+	switch (code)
+	{
+	case SYMMAT_OK:
+		return "no error";
+	case SYMMAT_INVALID_MATRIX:
+		return "invalid matrix (need cols >= 1, stride 0 or >= cols, and data and output arrays)";
+	case SYMMAT_UNKNOWN_METRIC:
+		return "unknown metric (pearson, cosine, jaccard, bray-curtis or rho)";
+	case SYMMAT_UNKNOWN_PRECISION:
+		return "unknown precision (double, float or mixed)";
+	case SYMMAT_OUT_OF_MEMORY:
+		return "out of memory";
+	case SYMMAT_INTERNAL_ERROR:
+		return "internal error (such as failing to start worker threads)";
+	}
+	return "unknown error";
+}
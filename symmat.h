@@ -0,0 +1,183 @@
+#ifndef SYMMAT_H
+#define SYMMAT_H
+
+// symmat library: all-pairs similarity of the rows of an in-memory matrix,
+// with permutation p-values, and the approximate search for strongly
+// correlated pairs. The command line tool is a thin wrapper around this; C
+// callers use symmat_c.h.
+//
+// Matrices are borrowed, never copied: the engine reads the caller's values in
+// place and keeps only its own preprocessed rows. Missing values are NaN.
+//
+// Build the library into a program with
+//
+//	g++ -O2 -pthread <program>.cpp symmat.cpp
+//
+// or as a shared library with g++ -O2 -fPIC -shared symmat.cpp -o libsymmat.so
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Stats;
+
+namespace symmat
+{
+
+// Row-major matrix owned by the caller. Row r starts at data + r * stride;
+// a stride of 0 means the rows are packed (stride = cols).
+struct Matrix
+{
+	const double *data = NULL;
+	int rows = 0;
+	int cols = 0;
+	long stride = 0;
+};
+
+struct Options
+{
+	// pearson, cosine, jaccard, bray-curtis or rho
+	std::string metric = "pearson";
+	// storage/accumulator precision: double, float (both float) or mixed
+	// (float storage, double sums)
+	std::string precision = "double";
+	// permutations per pair for the p-values; 0 skips the permutation test
+	long permutations = 0;
+	unsigned seed = 0;
+	// worker threads for correlate(); 0 uses one per CPU. For any value but
+	// 1, pairs are scheduled by work stealing and each pair's permutations
+	// come from its own random streams, so p-values depend on the seed but not
+	// on the thread count or the machine (they differ from the single-threaded
+	// stream of threads = 1). Only with 0 are the workers pinned to CPUs, so
+	// concurrent calls with a set count do not pile onto the same CPUs.
+	int threads = 1;
+	// optional phase timings and work counters (stats.h), with a counter slot
+	// per thread
+	Stats *stats = NULL;
+};
+
+// Values for the rows * (rows - 1) / 2 pairs a < b, packed row by row:
+// (0,1), (0,2), ..., (0,rows-1), (1,2), ...
+struct Result
+{
+	int rows = 0;
+	std::vector<double> values;
+	// same layout; empty if no permutations were run
+	std::vector<double> pValues;
+
+	static size_t index(int a, int b, int rows)
+	{
+		return (size_t)a * rows - (size_t)a * (a + 1) / 2 + (b - a - 1);
+	}
+	static size_t pairs(int rows)
+	{
+		return rows > 1 ? (size_t)rows * (rows - 1) / 2 : 0;
+	}
+	// value/p-value of the pair a != b, in either order
+	double value(int a, int b) const
+	{
+		return values[a < b ? index(a, b, rows) : index(b, a, rows)];
+	}
+	double pValue(int a, int b) const
+	{
+		return pValues[a < b ? index(a, b, rows) : index(b, a, rows)];
+	}
+};
+
+struct StrongPairOptions
+{
+	// report pairs with |r| at least this
+	double minR = 0.8;
+	// SimHash bits per band; 0 picks about log2(rows)
+	int bits = 0;
+	// number of bands; 0 picks enough for 95% recall at minR
+	int tables = 0;
+	// random pairs correlated exactly to estimate the recall
+	long recallSample = 100000;
+};
+
+struct StrongPair
+{
+	int a;
+	int b;
+	double r;
+	// NaN if no permutations were run
+	double p;
+};
+
+struct StrongPairs
+{
+	// strongest first
+	std::vector<StrongPair> pairs;
+	int bits = 0;
+	int tables = 0;
+	long candidates = 0;
+	// probability that a pair with |r| = minR becomes a candidate
+	double expectedRecall = 0.0;
+	// random pairs correlated exactly, those with |r| >= minR among them and
+	// those of these that were candidates; with sampledStrong 0 the sample
+	// says nothing about the recall
+	long sampledPairs = 0;
+	long sampledStrong = 0;
+	long sampledFound = 0;
+};
+
+// Metric values and, if options.permutations > 0, p-values of all pairs of
+// rows. False, with a message in *error if error is given, if the matrix or
+// the options are not valid.
+bool correlate(const Matrix &matrix, const Options &options, Result &result, std::string *error = NULL);
+
+// Pairs with |r| >= approx.minR, found by SimHash LSH without computing every
+// pair (pearson and cosine only); p-values are run for the pairs found only.
+bool findStrongPairs(const Matrix &matrix, const Options &options, const StrongPairOptions &approx, StrongPairs &result,
+					 std::string *error = NULL);
+
+class EngineCore;
+
+// A matrix preprocessed once and kept resident for many queries (a server, an
+// interactive session). The matrix stays borrowed and must outlive the engine.
+// Queries only read the engine, so any number of threads may run them at once.
+class Engine
+{
+public:
+	Engine();
+	~Engine();
+
+	// Preprocess matrix with options.metric and options.precision; the other
+	// options only serve as defaults for the caller. False, with a message in
+	// *error if error is given, if the matrix or the options are not valid.
+	bool load(const Matrix &matrix, const Options &options, std::string *error = NULL);
+	bool loaded() const;
+	int rows() const;
+	int cols() const;
+
+	// Metric value of rows a and b; NaN if they share fewer than two values
+	double value(int a, int b) const;
+	// p-value of rows a and b from permutations shuffles seeded with seed. If
+	// cancel is given, setting it stops the shuffling within one chunk of
+	// permutations and the p-value comes out NaN.
+	double pValue(int a, int b, long permutations, unsigned seed, const std::atomic<bool> *cancel = NULL) const;
+	// Row a against every row: values[b] is value(a, b), NaN for b == a. If
+	// pValues is given and permutations > 0, (*pValues)[b] is
+	// pValue(a, b, permutations, seed), so callers may compute any part of the
+	// row on its own and get the same numbers.
+	void row(int a, std::vector<double> &values, std::vector<double> *pValues = NULL, long permutations = 0, unsigned seed = 0) const;
+
+private:
+	Engine(const Engine &);
+	Engine &operator=(const Engine &);
+
+	std::unique_ptr<EngineCore> core;
+};
+
+// Description of a metric for report headings ("Pearson correlation
+// coefficient"), and the tail of its permutation test ("two-tail", "one-tail
+// (upper)" or "one-tail (lower)"). NULL if the metric is unknown.
+const char *metricDescription(const std::string &metric);
+const char *metricTail(const std::string &metric);
+
+} // namespace symmat
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SYMMAT_C_H
+#define SYMMAT_C_H
+
+/*
+C interface to the symmat library (symmat.h), for callers that cannot use C++:
+all-pairs similarity with permutation p-values on a borrowed row-major matrix
+of doubles, NaN for missing values. Results are packed into arrays the caller
+allocates, symmat_pair_count(rows) doubles each, pair a < b at
+symmat_pair_index(a, b, rows).
+*/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct symmat_options
+{
+	/* "pearson", "cosine", "jaccard", "bray-curtis" or "rho" */
+	const char *metric;
+	/* "double", "float" or "mixed" */
+	const char *precision;
+	/* permutations per pair; 0 skips the p-values */
+	long permutations;
+	unsigned seed;
+	/* worker threads, 0 for one per CPU (see symmat.h Options::threads) */
+	int threads;
+} symmat_options;
+
+enum
+{
+	SYMMAT_OK = 0,
+	SYMMAT_INVALID_MATRIX = 1,
+	SYMMAT_UNKNOWN_METRIC = 2,
+	SYMMAT_UNKNOWN_PRECISION = 3,
+	SYMMAT_OUT_OF_MEMORY = 4,
+	/* anything else that went wrong inside, e.g. worker threads not starting */
+	SYMMAT_INTERNAL_ERROR = 5
+};
+
+/* pearson, double precision, no permutations, seed 0, one thread */
+void symmat_default_options(symmat_options *options);
+
+size_t symmat_pair_count(int rows);
+size_t symmat_pair_index(int a, int b, int rows);
+
+/*
+Row r of the matrix starts at data + r * stride (stride 0: packed rows).
+values receives the metric value of every pair; p_values, which may be NULL,
+their p-values if options->permutations > 0. options may be NULL for the
+defaults. Returns SYMMAT_OK or one of the error codes above.
+*/
+int symmat_correlate(const double *data, int rows, int cols, long stride, const symmat_options *options, double *values,
+					 double *p_values);
+
+/* Message for an error code */
+const char *symmat_error_string(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef SYMMAT_TABLE_H
+#define SYMMAT_TABLE_H
+
+// Reading the tab-delimited input tables: a header line with one name per
+// column (after a blank corner cell), then one line per row starting with the
+// row name. Empty cells and NA/NaN are missing values and are stored as NaN.
+// Files without any tab are split on runs of whitespace instead, which cannot
+// represent empty cells.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <regex>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+struct Table
+{
+	int rows = 0;
+	int cols = 0;
+	std::vector<std::string> rowNames;
+	std::vector<std::string> columnNames;
+	// values[row * cols + col]
+	std::vector<double> values;
+};
+
+// Lines holding nothing but whitespace are skipped, wherever they are
+inline bool isBlankLine(const std::string &sLine)
+{
+	for (size_t i = 0; i < sLine.size(); i++)
+	{
+		if (!isspace((unsigned char)sLine[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Number of non-blank lines of the file, a last line without a trailing
+// newline included
+inline int countLinesInFile(const char *filename)
+{
+	std::ifstream inFile(filename);
+	int count = 0;
+	std::string sLine;
+	while (std::getline(inFile, sLine))
+	{
+		if (!isBlankLine(sLine))
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+// Split a line into its fields: on single tabs if there are any, otherwise on
+// runs of whitespace
+inline std::vector<std::string> splitFields(std::string sLine)
+{
+	if (!sLine.empty() && sLine[sLine.size() - 1] == '\r')
+	{
+		sLine.erase(sLine.size() - 1);
+	}
+	std::vector<std::string> fields;
+	if (sLine.find('\t') != std::string::npos)
+	{
+		size_t start = 0;
+		while (true)
+		{
+			size_t tab = sLine.find('\t', start);
+			fields.push_back(sLine.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+			if (tab == std::string::npos)
+			{
+				break;
+			}
+			start = tab + 1;
+		}
+	}
+	else
+	{
+		std::regex r("\\s+");
+		std::sregex_token_iterator iter(sLine.begin(),
+										sLine.end(),
+										r,
+										-1);
+		std::sregex_token_iterator end;
+		for (; iter != end; ++iter)
+		{
+			fields.push_back(iter->str());
+		}
+	}
+	return fields;
+}
+
+// NaN for the missing-value markers (empty, NA, NaN in any case), else atof
+inline double parseValue(const std::string &value)
+{
+	std::string lower;
+	for (size_t i = 0; i < value.size(); i++)
+	{
+		if (!isspace((unsigned char)value[i]))
+		{
+			lower += (char)tolower((unsigned char)value[i]);
+		}
+	}
+	if (lower.empty() || lower == "na" || lower == "nan")
+	{
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	return ::atof(value.c_str());
+}
+
+inline int countColumnsInFile(const char *filename)
+{
+
+	std::ifstream inFile(filename);
+	if (inFile.good())
+	{
+		std::string sLine;
+		while (getline(inFile, sLine) && isBlankLine(sLine))
+		{
+		}
+		std::vector<std::string> fields = splitFields(sLine);
+		// trailing tabs do not make columns
+		while (!fields.empty() && fields.back().empty())
+		{
+			fields.pop_back();
+		}
+		// the blank corner cell is not a column
+		if (!fields.empty() && fields[0].empty())
+		{
+			return (int)fields.size() - 1;
+		}
+		return (int)fields.size();
+	}
+	else
+	{
+		return -1;
+	}
+}
+
+// Returns false if the file cannot be read
+inline bool readTable(const char *filename, Table &table)
+{
+	// first line holds the column names, every other line is one row
+	table.rows = countLinesInFile(filename) - 1;
+	table.cols = countColumnsInFile(filename);
+	if (table.rows < 0 || table.cols < 0)
+	{
+		return false;
+	}
+
+	// cells missing at the end of a short line are missing values too
+	table.values.assign((size_t)table.rows * table.cols, std::numeric_limits<double>::quiet_NaN());
+	table.rowNames.assign(table.rows, "");
+	table.columnNames.assign(table.cols, "");
+	std::ifstream inFile(filename);
+	if (!inFile.good())
+	{
+		return false;
+	}
+
+	std::string sLine;
+	int rowNum = 0;
+	while (std::getline(inFile, sLine) && rowNum <= table.rows)
+	{
+		if (isBlankLine(sLine))
+		{
+			continue;
+		}
+		std::vector<std::string> fields = splitFields(sLine);
+		if (rowNum == 0)
+		{
+			size_t first = (!fields.empty() && fields[0].empty()) ? 1 : 0;
+			for (int columnNum = 0; columnNum < table.cols && first + columnNum < fields.size(); columnNum++)
+			{
+				table.columnNames[columnNum] = fields[first + columnNum];
+			}
+		}
+		else
+		{
+			if (!fields.empty())
+			{
+				table.rowNames[rowNum - 1] = fields[0];
+			}
+			for (int columnNum = 0; columnNum < table.cols && columnNum + 1 < (int)fields.size(); columnNum++)
+			{
+				table.values[(size_t)(rowNum - 1) * table.cols + columnNum] = parseValue(fields[columnNum + 1]);
+			}
+		}
+		++rowNum;
+	}
+	return true;
+}
+
+#endif
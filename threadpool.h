@@ -0,0 +1,154 @@
+#ifndef SYMMAT_THREADPOOL_H
+#define SYMMAT_THREADPOOL_H
+
+// A fixed pool of worker threads running queued tasks, and a bounded
+// producer/consumer queue for pipelines that should not read ahead without
+// limit.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// threads <= 0 uses one thread per core
+	explicit ThreadPool(int threads = 0)
+	{
+		if (threads <= 0)
+		{
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		}
+		for (int i = 0; i < threads; i++)
+		{
+			workers.push_back(std::thread([this, i] { work(i); }));
+		}
+	}
+
+	// Finishes the queued tasks first
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	int size() const
+	{
+		return (int)workers.size();
+	}
+
+	// Queue task; it is called with the index of the worker that runs it
+	void submit(std::function<void(int)> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+			pending++;
+		}
+		wakeup.notify_one();
+	}
+
+	// Block until at most limit tasks are queued or running
+	void wait(size_t limit = 0)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this, limit] { return pending <= limit; });
+	}
+
+private:
+	void work(int worker)
+	{
+		while (true)
+		{
+			std::function<void(int)> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+				{
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task(worker);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pending--;
+			}
+			finished.notify_all();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void(int)>> tasks;
+	size_t pending = 0;
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable finished;
+};
+
+// Queue holding at most capacity items: push() blocks while it is full, pop()
+// while it is empty and not closed
+template <class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1)
+	{
+	}
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	// False once the queue is closed and drained
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+		{
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// No more pushes; pop() returns what is left, then false
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+};
+
+#endif